@@ -0,0 +1,146 @@
+/*
+File:       Watcher.h
+
+Abstract:   Interface for running the watcher inside another program.
+
+Version: <1.3>
+
+Disclaimer: IMPORTANT:  This Apple software is supplied to you by 
+Apple Inc. ("Apple") in consideration of your agreement to the
+following terms, and your use, installation, modification or
+redistribution of this Apple software constitutes acceptance of these
+terms.  If you do not agree with these terms, please do not use,
+install, modify or redistribute this Apple software.
+
+In consideration of your agreement to abide by the following terms, and
+subject to these terms, Apple grants you a personal, non-exclusive
+license, under Apple's copyrights in this original Apple software (the
+"Apple Software"), to use, reproduce, modify and redistribute the Apple
+Software, with or without modifications, in source and/or binary forms;
+provided that if you redistribute the Apple Software in its entirety and
+without modifications, you must retain this notice and the following
+text and disclaimers in all such redistributions of the Apple Software. 
+Neither the name, trademarks, service marks or logos of Apple Inc. 
+may be used to endorse or promote products derived from the Apple
+Software without specific prior written permission from Apple.  Except
+as expressly stated in this notice, no other rights or licenses, express
+or implied, are granted by Apple herein, including but not limited to
+any patent rights that may be infringed by your derivative works or by
+other works in which the Apple Software may be incorporated.
+
+The Apple Software is provided by Apple on an "AS IS" basis.  APPLE
+MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND
+OPERATION ALONE OR IN COMBINATION WITH YOUR PRODUCTS.
+
+IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION,
+MODIFICATION AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED
+AND WHETHER UNDER THEORY OF CONTRACT, TORT (INCLUDING NEGLIGENCE),
+STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+Copyright (C) 2007 Apple Inc. All Rights Reserved.
+
+*/
+
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Everything the Watcher tool does is available to other programs
+// through this interface.  A program creates a context, sets options
+// on it (the same names as in a config file, e.g. "path", "latency"
+// or "convertJobs"), and either runs the watcher on its own thread
+// with watcher_run() or uses watcher_scan_tree() and
+// watcher_convert_path() to do the work on demand.
+//
+// The watcher keeps its state for the whole process, not in the
+// context, so there can only be one context at a time.
+//
+typedef struct watcher_context watcher_context;
+
+typedef enum {
+    WATCHER_NOTES_CONVERTED,            // notes were written out to a .skim file
+    WATCHER_CONVERSION_FAILED,
+    WATCHER_NOTES_IMPORTED,             // a .skim file was put back into the PDF (importSkim)
+    WATCHER_IMPORT_FAILED
+} watcher_event;
+
+//
+// Called for every conversion and import.  Conversions are reported
+// on the thread running watcher_run() (or the one that called
+// watcher_scan_tree() or watcher_convert_path()), imports on whichever
+// thread ran them, which may be the background scanner.
+//
+typedef void (*watcher_callback)(watcher_context *ctx, watcher_event event, const char *path, void *info);
+
+//
+// Returns NULL (errno EBUSY) if there is a context already.  path may
+// be NULL.  watcher_destroy() (not while watcher_run() is running)
+// also stops the threads the context started and forgets what it
+// found, so the next context starts afresh.
+//
+watcher_context *watcher_create(const char *path);
+void             watcher_destroy(watcher_context *ctx);
+
+//
+// Options set here are kept over ones from the config file, also when
+// it is re-read on SIGHUP.  Returns -1 for an unknown option or a
+// missing value, otherwise how many values were used (0 for flags
+// such as "fileEvents", 1 for the rest).
+//
+int              watcher_set_option(watcher_context *ctx, const char *name, const char *value);
+int              watcher_load_config(watcher_context *ctx, const char *file);
+const char      *watcher_get_path(watcher_context *ctx);
+void             watcher_set_callback(watcher_context *ctx, watcher_callback callback, void *info);
+
+//
+// Watch until watcher_stop() (which may be called from any thread,
+// also before watcher_run() has started) or SIGINT.  State is kept in the current directory as for the tool.
+//
+int              watcher_run(watcher_context *ctx);
+void             watcher_stop(watcher_context *ctx);
+
+//
+// Scan path (somewhere under the watched path) again from scratch,
+// converting any notes found, and return its directory count and size.
+// Without watcher_run() this waits for the conversions as well.
+//
+int              watcher_scan_tree(watcher_context *ctx, const char *path, int *num_dirs, off_t *size);
+
+// Returns 1 if notes were converted, 0 if there were none, -1 on failure.
+int              watcher_convert_path(watcher_context *ctx, const char *path);
+
+void             watcher_dump_stats(watcher_context *ctx, FILE *fp);
+
+//
+// Print the files whose notes contain all the words in query (needs
+// "indexNotes").  Without watcher_run() this reads the index left in
+// the current directory.  Returns the number of matches or -1.
+//
+int              watcher_search(watcher_context *ctx, const char *query, FILE *out);
+
+//
+// Send a control command to a watcher running in another process and
+// copy its reply to out.  Returns 0 if it answered "ok", 1 if it
+// didn't and -1 if it couldn't be reached.
+//
+int              watcher_send_command(const char *command, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,417 @@
+/*
+File:       WatcherBench.c
+
+Abstract:   Reproducible measurements of the work WatcherLib.c does.
+
+Version: <1.3>
+
+Disclaimer: IMPORTANT:  This Apple software is supplied to you by 
+Apple Inc. ("Apple") in consideration of your agreement to the
+following terms, and your use, installation, modification or
+redistribution of this Apple software constitutes acceptance of these
+terms.  If you do not agree with these terms, please do not use,
+install, modify or redistribute this Apple software.
+
+In consideration of your agreement to abide by the following terms, and
+subject to these terms, Apple grants you a personal, non-exclusive
+license, under Apple's copyrights in this original Apple software (the
+"Apple Software"), to use, reproduce, modify and redistribute the Apple
+Software, with or without modifications, in source and/or binary forms;
+provided that if you redistribute the Apple Software in its entirety and
+without modifications, you must retain this notice and the following
+text and disclaimers in all such redistributions of the Apple Software. 
+Neither the name, trademarks, service marks or logos of Apple Inc. 
+may be used to endorse or promote products derived from the Apple
+Software without specific prior written permission from Apple.  Except
+as expressly stated in this notice, no other rights or licenses, express
+or implied, are granted by Apple herein, including but not limited to
+any patent rights that may be infringed by your derivative works or by
+other works in which the Apple Software may be incorporated.
+
+The Apple Software is provided by Apple on an "AS IS" basis.  APPLE
+MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND
+OPERATION ALONE OR IN COMBINATION WITH YOUR PRODUCTS.
+
+IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION,
+MODIFICATION AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED
+AND WHETHER UNDER THEORY OF CONTRACT, TORT (INCLUDING NEGLIGENCE),
+STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+Copyright (C) 2007 Apple Inc. All Rights Reserved.
+
+*/
+
+
+//
+// Measures things that depend too much on the disk to guess at.
+//
+//    cc -O2 -o WatcherBench WatcherBench.c -framework CoreServices -framework CoreFoundation
+//    ./WatcherBench commit [files] [group sizes...]
+//    ./WatcherBench scan [files] [latency]
+//
+// "commit" converts the notes of files PDFs in one folder (256 by
+// default) with each -groupCommit size given (1 and 32 by default)
+// and prints how long it took and how many syncs it needed.  Run it
+// on the disk the papers are on; the folder is made in the current
+// directory, since /tmp may be on a different one.
+//
+// skimnotes is replaced by this program itself, which just copies the
+// notes attribute to the .skim file and removes it, so the times are
+// the cost of starting two processes per file and of making the
+// results durable, without Skim's own parsing.
+//
+// "scan" makes a tree of files PDFs (100,000 by default, 1000 to a
+// folder) and scans it once reading directories with getattrlistbulk()
+// and once with readdir()/lstat(), as -noBulkAttrs does.  Each
+// opendir(), getattrlistbulk(), lstat() and getxattr() first sleeps
+// for latency microseconds (100 by default), which stands in for the
+// round trip each of them costs on a network volume; give 0 to see the
+// local disk as it is.  readdir() isn't slowed down, since it reads
+// many entries at a time either way.  It prints the time each scan
+// took and how many calls of each kind it made.
+//
+// It includes WatcherLib.c, rather than linking against it, so that
+// it can run skimnotes from here and get in between the scanner and
+// the system calls it makes.
+//
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/attr.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <unistd.h>
+
+char    bench_self[MAXPATHLEN];
+#define SKIMNOTES_PATH  bench_self
+
+static DIR     *bench_opendir(const char *name);
+static int      bench_lstat(const char *path, struct stat *st);
+static int      bench_getattrlistbulk(int dirfd, void *attrs, void *buf, size_t size, uint64_t options);
+static ssize_t  bench_getxattr(const char *path, const char *name, void *value, size_t size, uint32_t position, int options);
+
+#define opendir(name)                       bench_opendir(name)
+#define lstat(path, st)                     bench_lstat(path, st)
+#define getattrlistbulk(fd, a, b, s, o)     bench_getattrlistbulk(fd, a, b, s, o)
+#define getxattr(p, n, v, s, pos, o)        bench_getxattr(p, n, v, s, pos, o)
+
+#include "WatcherLib.c"
+
+#undef opendir
+#undef lstat
+#undef getattrlistbulk
+#undef getxattr
+
+#define BENCH_NOTES_SIZE    2048
+#define DEFAULT_FILES       256
+#define DEFAULT_SCAN_FILES  100000
+#define DEFAULT_LATENCY     100         // microseconds
+#define FILES_PER_DIR       1000
+
+char        bench_root[MAXPATHLEN];
+useconds_t  bench_latency = 0;
+uint64_t    num_round_trips = 0;
+
+//
+// Prototypes
+//
+static int    fake_skimnotes(int argc, const char *argv[]);
+static void   make_bench_dir(const char *prefix);
+static void   remove_bench_dir(void);
+static int    bench_commit(int argc, const char *argv[]);
+static void   round_trip(void);
+static void   make_scan_tree(int files);
+static int    bench_scan(int argc, const char *argv[]);
+static void   usage(const char *progname);
+
+
+//
+// What the scanner calls, with a round trip's worth of waiting first.
+//
+static void
+round_trip(void)
+{
+    if (bench_latency > 0) {
+	usleep(bench_latency);
+    }
+    __atomic_fetch_add(&num_round_trips, 1, __ATOMIC_RELAXED);
+}
+
+
+static DIR *
+bench_opendir(const char *name)
+{
+    round_trip();
+    return opendir(name);
+}
+
+
+static int
+bench_lstat(const char *path, struct stat *st)
+{
+    round_trip();
+    return lstat(path, st);
+}
+
+
+static int
+bench_getattrlistbulk(int dirfd, void *attrs, void *buf, size_t size, uint64_t options)
+{
+    round_trip();
+    return getattrlistbulk(dirfd, attrs, buf, size, options);
+}
+
+
+static ssize_t
+bench_getxattr(const char *path, const char *name, void *value, size_t size, uint32_t position, int options)
+{
+    round_trip();
+    return getxattr(path, name, value, size, position, options);
+}
+
+
+//
+// "get <pdf> <skim>" and "remove <pdf>", as skimnotes does them,
+// for when run_skimnotes() starts us.
+//
+static int
+fake_skimnotes(int argc, const char *argv[])
+{
+    char     buff[BENCH_NOTES_SIZE];
+    ssize_t  len;
+    int      fd;
+
+    if (strcmp(argv[1], "remove") == 0) {
+	return removexattr(argv[2], SKIM_NOTES_XATTR, 0) != 0;
+    }
+    if (argc < 4 || (len = getxattr(argv[2], SKIM_NOTES_XATTR, buff, sizeof(buff), 0, 0)) < 0) {
+	return 1;
+    }
+    fd = open(argv[3], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0 || write(fd, buff, len) != len) {
+	return 1;
+    }
+
+    return close(fd) != 0;
+}
+
+
+static void
+make_bench_dir(const char *prefix)
+{
+    char template[MAXPATHLEN];
+
+    snprintf(template, sizeof(template), "%s.XXXXXX", prefix);
+    if (mkdtemp(template) == NULL || realpath(template, bench_root) == NULL) {
+	fprintf(stderr, "can't make a directory to work in (%s)\n", strerror(errno));
+	exit(1);
+    }
+}
+
+
+static void
+remove_bench_dir(void)
+{
+    char cmd[MAXPATHLEN+16];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", bench_root);
+    system(cmd);
+}
+
+
+static int
+bench_commit(int argc, const char *argv[])
+{
+    char      path[MAXPATHLEN], notes[BENCH_NOTES_SIZE];
+    int       files = DEFAULT_FILES, defaults[] = { 1, 32 }, *sizes = defaults;
+    int       num_sizes = 2, i, j, fd, bad = 0;
+    uint64_t  commits, syncs;
+    double    start, elapsed;
+
+    if (argc > 2) {
+	files = atoi(argv[2]);
+    }
+    if (argc > 3) {
+	num_sizes = argc - 3;
+	sizes = calloc(num_sizes, sizeof(int));
+	for(i=0; i < num_sizes; i++) {
+	    sizes[i] = atoi(argv[i+3]);
+	}
+    }
+    memset(notes, 'n', sizeof(notes));
+    make_bench_dir("WatcherBench");
+
+    for(i=0; i < num_sizes; i++) {
+	for(j=0; j < files; j++) {
+	    snprintf(path, sizeof(path), "%s/p%d.pdf", bench_root, j);
+	    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	    if (fd < 0 || close(fd) != 0 || setxattr(path, SKIM_NOTES_XATTR, notes, sizeof(notes), 0, 0) != 0) {
+		fprintf(stderr, "can't make %s (%s)\n", path, strerror(errno));
+		remove_bench_dir();
+		exit(1);
+	    }
+	}
+	sync();
+
+	pthread_mutex_lock(&conversion_lock);
+	commits = num_group_commits;
+	syncs   = num_commit_syncs;
+	pthread_mutex_unlock(&conversion_lock);
+
+	set_group_commit(sizes[i]);
+	start = time_now();
+	for(j=0; j < files; j++) {
+	    snprintf(path, sizeof(path), "%s/p%d.pdf", bench_root, j);
+	    queue_conversion(path, LANE_BULK, start);
+	}
+	wait_for_conversions();     // converts on this thread, there are no workers
+	elapsed = time_now() - start;
+
+	for(j=0; j < files; j++) {
+	    snprintf(path, sizeof(path), "%s/p%d.pdf", bench_root, j);
+	    if (getxattr(path, SKIM_NOTES_XATTR, NULL, 0, 0, 0) > 0) {
+		bad = 1;
+	    }
+	}
+	pthread_mutex_lock(&conversion_lock);
+	commits = num_group_commits - commits;
+	syncs   = num_commit_syncs - syncs;
+	pthread_mutex_unlock(&conversion_lock);
+	collect_finished_conversions();
+
+	printf("groupCommit %3d: %d files in %.3f sec, %.1f files/sec, %llu commits, %llu syncs%s\n",
+	       sizes[i], files, elapsed, files / elapsed, (unsigned long long)commits,
+	       (unsigned long long)syncs, bad ? " (some notes weren't converted)" : "");
+    }
+
+    remove_bench_dir();
+    return bad;
+}
+
+
+// files/FILES_PER_DIR folders of FILES_PER_DIR empty PDFs each
+static void
+make_scan_tree(int files)
+{
+    char  path[MAXPATHLEN];
+    int   i, fd;
+
+    for(i=0; i < files; i++) {
+	if (i % FILES_PER_DIR == 0) {
+	    snprintf(path, sizeof(path), "%s/d%d", bench_root, i / FILES_PER_DIR);
+	    mkdir(path, 0755);
+	}
+	snprintf(path, sizeof(path), "%s/d%d/p%d.pdf", bench_root, i / FILES_PER_DIR, i);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, i % 4096) != 0 || close(fd) != 0) {
+	    fprintf(stderr, "can't make %s (%s)\n", path, strerror(errno));
+	    remove_bench_dir();
+	    exit(1);
+	}
+    }
+}
+
+
+static int
+bench_scan(int argc, const char *argv[])
+{
+    int         files = DEFAULT_SCAN_FILES, latency = DEFAULT_LATENCY;
+    int         bulk, num_dirs, first_dirs = -1, bad = 0;
+    off_t       size, first_size = -1;
+    uint64_t    bulk_calls, lstats, trips;
+    double      start, elapsed;
+
+    if (argc > 2) {
+	files = atoi(argv[2]);
+    }
+    if (argc > 3) {
+	latency = atoi(argv[3]);
+    }
+    make_bench_dir("WatcherBench");
+    make_scan_tree(files);
+    set_state_root(bench_root);
+
+    // once without any latency, so that both scans find it all cached
+    scan_directory(bench_root, 1, 1, 0);
+    while (scan_in_progress()) {
+	usleep(1000);
+    }
+
+    for(bulk=1; bulk >= 0; bulk--) {
+	discard_all_dir_items();
+	set_bulk_attrs(bulk);
+	bulk_calls = __atomic_load_n(&num_bulk_calls, __ATOMIC_RELAXED);
+	lstats     = __atomic_load_n(&num_lstats, __ATOMIC_RELAXED);
+	trips      = __atomic_load_n(&num_round_trips, __ATOMIC_RELAXED);
+
+	bench_latency = latency;
+	start = time_now();
+	scan_directory(bench_root, 1, 1, 0);
+	while (scan_in_progress()) {
+	    usleep(1000);
+	}
+	elapsed = time_now() - start;
+	bench_latency = 0;
+
+	bulk_calls = __atomic_load_n(&num_bulk_calls, __ATOMIC_RELAXED) - bulk_calls;
+	lstats     = __atomic_load_n(&num_lstats, __ATOMIC_RELAXED) - lstats;
+	trips      = __atomic_load_n(&num_round_trips, __ATOMIC_RELAXED) - trips;
+
+	// both have to come up with the same answer
+	get_subtree_totals(bench_root, &num_dirs, &size);
+	if (first_dirs < 0) {
+	    first_dirs = num_dirs;
+	    first_size = size;
+	} else if (num_dirs != first_dirs || size != first_size) {
+	    bad = 1;
+	}
+
+	printf("%-15s %d files, %dus latency: %.3f sec, %.0f files/sec, %llu bulk calls, %llu lstats, %llu round trips%s\n",
+	       bulk ? "getattrlistbulk" : "noBulkAttrs", files, latency, elapsed, files / elapsed,
+	       (unsigned long long)bulk_calls, (unsigned long long)lstats, (unsigned long long)trips,
+	       (bulk && !__atomic_load_n(&use_bulk_attrs, __ATOMIC_RELAXED)) ? " (not supported here, fell back)" : "");
+    }
+    if (bad) {
+	printf("the two scans didn't agree\n");
+    }
+
+    stop_scanner();
+    remove_bench_dir();
+    return bad;
+}
+
+
+static void
+usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s commit [files] [group sizes...]\n", progname);
+    fprintf(stderr, "       %s scan [files] [latency]\n", progname);
+    exit(1);
+}
+
+
+int
+main(int argc, const char * argv[])
+{
+    if (argc > 2 && (strcmp(argv[1], "get") == 0 || strcmp(argv[1], "remove") == 0)) {
+	return fake_skimnotes(argc, argv);
+    }
+    if (argc < 2 || realpath(argv[0], bench_self) == NULL) {
+	usage(argv[0]);
+    }
+    log_level = LOG_LEVEL_ERROR;
+
+    if (strcmp(argv[1], "commit") == 0) {
+	return bench_commit(argc, argv);
+    } else if (strcmp(argv[1], "scan") == 0) {
+	return bench_scan(argc, argv);
+    }
+    usage(argv[0]);
+
+    return 1;
+}
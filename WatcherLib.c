@@ -0,0 +1,8568 @@
+/*
+File:       WatcherLib.c
+
+Abstract:   The watcher, directory state store and notes converter
+            behind the API in Watcher.h.
+
+Version: <1.3>
+
+Disclaimer: IMPORTANT:  This Apple software is supplied to you by 
+Apple Inc. ("Apple") in consideration of your agreement to the
+following terms, and your use, installation, modification or
+redistribution of this Apple software constitutes acceptance of these
+terms.  If you do not agree with these terms, please do not use,
+install, modify or redistribute this Apple software.
+
+In consideration of your agreement to abide by the following terms, and
+subject to these terms, Apple grants you a personal, non-exclusive
+license, under Apple's copyrights in this original Apple software (the
+"Apple Software"), to use, reproduce, modify and redistribute the Apple
+Software, with or without modifications, in source and/or binary forms;
+provided that if you redistribute the Apple Software in its entirety and
+without modifications, you must retain this notice and the following
+text and disclaimers in all such redistributions of the Apple Software. 
+Neither the name, trademarks, service marks or logos of Apple Inc. 
+may be used to endorse or promote products derived from the Apple
+Software without specific prior written permission from Apple.  Except
+as expressly stated in this notice, no other rights or licenses, express
+or implied, are granted by Apple herein, including but not limited to
+any patent rights that may be infringed by your derivative works or by
+other works in which the Apple Software may be incorporated.
+
+The Apple Software is provided by Apple on an "AS IS" basis.  APPLE
+MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND
+OPERATION ALONE OR IN COMBINATION WITH YOUR PRODUCTS.
+
+IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION,
+MODIFICATION AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED
+AND WHETHER UNDER THEORY OF CONTRACT, TORT (INCLUDING NEGLIGENCE),
+STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+Copyright (C) 2007 Apple Inc. All Rights Reserved.
+
+*/
+
+//
+// This program is a simple example of using the FSEvents
+// framework that monitors a directory hierarchy and keeps
+// track of the total size of data contained in it.  When
+// a directory inside of it changes, it recalculates the
+// size of that directory and updates the total size.
+//
+// The program is intentionally simplistic but demonstrates
+// the use of the FSEvents api in a hopefully clear fashion.
+//
+// Everything apart from the command line lives in this file, so that
+// other programs can link it and drive it through Watcher.h instead
+// of running the Watcher tool.  Watcher.c is the command line front
+// end.  To compile:
+//    dtrace -h -s WatcherProbes.d -o WatcherProbes.h
+//    cc -Wall -g -o Watcher Watcher.c WatcherLib.c -framework CoreServices -framework CoreFoundation
+//
+// (the first step is optional, see trace() below).
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/event.h>
+#include <sys/resource.h>
+#include <sys/attr.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sysctl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <assert.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>
+#include <pthread.h>
+#include <mach/mach.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <launch.h>
+
+#include <sys/xattr.h>
+
+#include "Watcher.h"
+
+typedef struct _settings_t {
+    dev_t                dev;
+    FSEventStreamEventId since_when;
+    CFAbsoluteTime       latency;
+    const char          *fullpath;
+    CFUUIDRef            dev_uuid;
+    char                 mount_point[MAXPATHLEN];
+    int                  file_events;
+    double               scan_ops_per_sec;
+    double               scan_bytes_per_sec;
+    off_t                memory_budget;
+    double               evict_after;
+    double               poll_interval;
+    double               idle_exit;
+    int                  local_volume;
+    int                  no_bulk_attrs;
+    int                  import_skim;
+    int                  import_jobs;
+    int                  index_notes;
+    int                  convert_jobs;
+    int                  group_commit;
+    int                  log_level;
+    int                  log_json;
+    const char          *log_file;
+    const char          *snapshot_file;
+    FSEventStreamRef     stream_ref;
+    const char          *config_file;
+    struct watcher_context *context;
+    char                 root[PATH_MAX];
+    char                 log_path[PATH_MAX];
+    char                 snapshot_name[PATH_MAX];
+} settings_t;
+
+//
+// What a watcher_context (see Watcher.h) holds besides the settings.
+// The rest of the state is still global to the process, which is
+// why there can only be one context at a time.
+//
+// watcher_stop() can come from any thread at any time, also before
+// watcher_run() has got as far as the run loop.  So it sets
+// stop_requested, which is checked just before the run loop starts,
+// and signals stop_source, which stops the run loop once it is going.
+//
+struct watcher_context {
+    settings_t           settings;
+    char               **option_names;     // from watcher_set_option(), they win over the config file
+    char               **option_values;
+    int                  num_options;
+    char                *config_file;
+    watcher_callback     callback;
+    void                *callback_info;
+    int                  stop_requested;   // atomic
+    pthread_mutex_t      run_lock;         // for the two below
+    CFRunLoopRef         run_loop;         // while watcher_run() is running
+    CFRunLoopSourceRef   stop_source;
+};
+
+watcher_context *active_context=NULL;
+
+
+//
+// Prototypes
+//
+void  scan_directory(const char *path, int add, int recursive, int depth);
+void  set_scan_budget(double ops_per_sec, double bytes_per_sec);
+void  charge_scan_budget(int ops, off_t bytes);
+void  pay_scan_debt(void);
+int   scan_in_progress(void);
+void  cancel_pending_scans(void);
+void  stop_scanner(void);
+void  dump_stats(FILE *fp);
+void  set_bulk_attrs(int enabled);
+void  set_stale_inodes(int stale);
+void  set_poll_interval(double interval, int local_volume);
+void  dump_poll_stats(FILE *fp);
+void  note_activity(void);
+void  mark_ready(double start);
+void  set_idle_exit(double seconds);
+void  dump_idle_stats(FILE *fp);
+void  set_memory_budget(off_t budget, double evict_after);
+void  enforce_memory_budget(void);
+int   save_dir_items(const char *name);
+int   load_dir_items(const char *name);
+int   export_snapshot(const char *items_name, const char *name);
+int   import_snapshot(const char *name);
+void  dump_snapshot_stats(FILE *fp);
+const char *snapshot_path(settings_t *settings, char *buff, size_t size);
+void  discard_all_dir_items(void);
+void  discard_detached_dir_items(void);
+void  set_state_root(const char *root);
+int   get_num_dir_items(void);
+int   remove_dir_and_children(const char *name);
+int   check_children_of_dir(const char *dirname);
+int   reconcile_dir_items(const char *path, time_t since);
+void  queue_reconcile(const char *path, time_t since);
+off_t get_total_size(void);
+
+void  save_stream_info(uint64_t last_id, CFUUIDRef dev_uuid);
+int   load_stream_info(uint64_t *since_when, CFUUIDRef *uuid_ref_ptr);
+
+int   setup_run_loop_signal_handler(CFRunLoopRef loop, settings_t *settings);
+void  cleanup_run_loop_signal_handler(CFRunLoopRef loop);
+
+int   setup_control_socket(CFRunLoopRef loop, settings_t *settings);
+void  cleanup_control_socket(CFRunLoopRef loop);
+
+int   get_dev_info(settings_t *settings);
+void  init_settings(watcher_context *ctx, settings_t *settings);
+int   load_config_file(const char *name, settings_t *settings);
+void  resolve_root(const char *path, char *fullpath, size_t len);
+void  reload_settings(settings_t *settings);
+FSEventStreamRef create_stream(settings_t *settings);
+CFMutableArrayRef create_cfarray_from_path(const char *path);
+
+void execute_for_path(const char *path);
+void notify_client(watcher_event event, const char *path);
+void start_conversion_workers(int num_workers);
+int  conversions_idle(void);
+void set_group_commit(int max_files);
+void stop_conversion_workers(void);
+void wait_for_conversions(void);
+void wait_for_path_conversions(const char *path);
+int  save_conversion_queue(const char *name);
+void load_conversion_queue(const char *name);
+void discard_conversion_queue(void);
+void collect_finished_conversions(void);
+void dump_conversion_stats(FILE *fp);
+void set_skim_import(int enabled, int jobs);
+void run_skim_imports(void);
+int  save_skim_sync_state(const char *name);
+int  load_skim_sync_state(const char *name);
+void set_notes_index(int enabled);
+char *read_text_notes(const char *path);
+void update_notes_index(const char *path, const char *text);
+int  search_notes_index(const char *query, FILE *out);
+int  load_notes_index(const char *name, int writable);
+void start_loading_notes_index(const char *name);
+void close_notes_index(void);
+void dump_index_stats(FILE *fp);
+
+//
+// Logging.  Messages go through log_msg(), which costs one comparison
+// when their level is turned off.  Everything else happens in the
+// logging section at the end of this file.
+//
+#define LOG_LEVEL_ERROR    0
+#define LOG_LEVEL_WARNING  1
+#define LOG_LEVEL_INFO     2
+#define LOG_LEVEL_DEBUG    3
+
+#define log_msg(level, ...)  do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+int                log_level = LOG_LEVEL_INFO;
+__thread uint64_t  log_event_id = 0;      // the event being handled, if any
+
+void  log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int   log_level_from_name(const char *name);
+int   start_logger(const char *log_file, int json);
+void  stop_logger(void);
+void  dump_log_stats(FILE *fp);
+
+//
+// Static probes (USDT, see WatcherProbes.d).  trace(EVENT_BATCH_DONE, ...)
+// fires watcher:::event-batch-done.  The arguments are only worked out
+// while somebody is tracing it, and without the generated header the
+// probes aren't there at all.
+//
+#if defined(__has_include)
+#if __has_include("WatcherProbes.h")
+#include "WatcherProbes.h"
+#define HAVE_WATCHER_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_WATCHER_PROBES
+#define trace(probe, ...)       do { if (WATCHER_##probe##_ENABLED()) WATCHER_##probe(__VA_ARGS__); } while (0)
+#define tracing(probe)          WATCHER_##probe##_ENABLED()
+#else
+static inline void trace_nothing(int unused, ...) { }
+#define trace(probe, ...)       do { if (0) trace_nothing(0, __VA_ARGS__); } while (0)
+#define tracing(probe)          0
+#endif
+
+static double   time_now(void);
+static uint64_t trace_usecs_since(double start);
+
+//
+// When the directory state was last known to match the disk, so that
+// after losing events only things changed since then need checking.
+// See reconcile_dir_items().
+//
+#define RECONCILE_SLACK  2          // seconds, for timestamp granularity
+
+time_t last_sync_time=0;
+
+//
+//--------------------------------------------------------------------------------
+// The FSEventsStreamCallback
+//
+
+//
+// In file events mode these are the item flags that mean the contents
+// of the parent directory changed.  Anything else on a file (xattrs,
+// data, inode metadata) only concerns that one file.
+//
+#define ITEM_STRUCTURE_FLAGS  (kFSEventStreamEventFlagItemCreated | \
+			       kFSEventStreamEventFlagItemRemoved | \
+			       kFSEventStreamEventFlagItemRenamed)
+
+#define ITEM_KIND_FLAGS       (kFSEventStreamEventFlagItemIsFile  | \
+			       kFSEventStreamEventFlagItemIsDir   | \
+			       kFSEventStreamEventFlagItemIsSymlink)
+
+//
+// Remember that the parent directory of path needs reconciling once
+// the whole batch has been looked at.  A burst of events in one
+// directory only results in a single pass over it.
+//
+static void
+add_parent_to_check(const char *path, char ***dirs, int *num_dirs)
+{
+    char  *parent, *slash, **new;
+    int    i;
+
+    parent = strdup(path);
+    if (parent == NULL) {
+	return;
+    }
+    slash = strrchr(parent, '/');
+    if (slash == NULL || slash == parent) {
+	free(parent);
+	return;
+    }
+    *slash = '\0';
+
+    for(i=0; i < *num_dirs; i++) {
+	if (strcmp((*dirs)[i], parent) == 0) {
+	    free(parent);
+	    return;
+	}
+    }
+
+    new = realloc(*dirs, (*num_dirs+1) * sizeof(char *));
+    if (new == NULL) {
+	free(parent);
+	return;
+    }
+    *dirs = new;
+    (*dirs)[(*num_dirs)++] = parent;
+}
+
+
+static void
+fsevents_callback(FSEventStreamRef streamRef, void *clientCallBackInfo,
+                  int numEvents,
+                  const char *const eventPaths[],
+                  const FSEventStreamEventFlags *eventFlags,
+                  const uint64_t *eventIDs)
+{
+    settings_t *settings = (settings_t *)clientCallBackInfo;
+    const char *full_path = (const char *)settings->fullpath;
+    int         i, len, recursive = 0;
+    char        path_buff[PATH_MAX];
+    char      **dirs_to_check = NULL;
+    int         num_dirs_to_check = 0;
+    time_t      missed_since;
+    double      trace_start = 0;
+
+    if (numEvents > 0 && tracing(EVENT_BATCH_DONE)) {
+	trace_start = time_now();
+    }
+    trace(EVENT_BATCH_START, numEvents, numEvents ? eventIDs[0] : 0, numEvents ? eventIDs[numEvents-1] : 0);
+
+    //
+    // Anything we missed (dropped events, or a MustScanSubDirs) happened
+    // after the previous batch was delivered, give or take the latency.
+    //
+    missed_since = last_sync_time - (time_t)settings->latency - RECONCILE_SLACK;
+    last_sync_time = time(NULL);
+    note_activity();
+
+    // record what the workers wrote before we look at any of it
+    collect_finished_conversions();
+
+
+    for (i=0; i < numEvents; i++) {
+	log_event_id = eventIDs[i];
+	log_msg(LOG_LEVEL_DEBUG, "event %llu flags 0x%x for %s", (unsigned long long)eventIDs[i],
+		(unsigned)eventFlags[i], eventPaths[i]);
+	
+	//
+	// First, make a copy of the event path so we can modify it.
+	//
+	strcpy(path_buff, eventPaths[i]);
+	len = strlen(path_buff);
+	if (path_buff[len-1] == '/') {
+	    // chop off a trailing slash so that scan_directory() works
+	    path_buff[--len] = '\0';
+	}
+
+	//
+	// Now check the flags for this event to see if we have to
+	// do anything special.
+	//
+	// If we get a HistoryDone event we can just skip it.
+	//
+	// If we get a RootChanged event, check if the root exists
+	// or not.  If not, throw away our state.  If it does, then
+	// rebuild our state.
+	//
+	// Then of course if the MustScanSubDirs flag is set we
+	// have to do a recursive scan to update our state.
+	//
+	if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone) {
+	    log_msg(LOG_LEVEL_INFO, "Done processing historical events.  Current total size is: %lld for path: %s", get_total_size(), settings->fullpath);
+	    continue;
+	} else if (eventFlags[i] & kFSEventStreamEventFlagRootChanged) {
+	    struct stat st;
+	    
+	    if (stat(full_path, &st) == 0) {
+		log_msg(LOG_LEVEL_WARNING, "Root path %s now exists!", full_path);
+		recursive = 1;
+	    } else {
+		log_msg(LOG_LEVEL_WARNING, "Root path %s no longer exists!  New total size: 0", full_path);
+		discard_all_dir_items();
+		continue;
+	    }
+
+	} else if (eventFlags[i] & kFSEventStreamEventFlagMustScanSubDirs) {
+	    recursive = 1;
+
+	    if (eventFlags[i] & kFSEventStreamEventFlagUserDropped) {
+		log_msg(LOG_LEVEL_WARNING, "BAD NEWS! We dropped events.");
+		strlcpy(path_buff, full_path, sizeof(path_buff));
+	    } else if (eventFlags[i] & kFSEventStreamEventFlagKernelDropped) {
+		log_msg(LOG_LEVEL_WARNING, "REALLY BAD NEWS! The kernel dropped events.");
+		strlcpy(path_buff, full_path, sizeof(path_buff));
+	    }
+	} else if (settings->file_events && (eventFlags[i] & ITEM_KIND_FLAGS)) {
+	    //
+	    // In file events mode the event names the item itself.  A
+	    // notes change on a file goes straight to conversion; only
+	    // creates, deletes and renames (of either files or directories)
+	    // need the parent directory reconciled.  Renames arrive as a
+	    // pair of events, one for each parent, and the inode matching
+	    // in check_children_of_dir() turns them back into a move.
+	    //
+	    if (eventFlags[i] & ITEM_STRUCTURE_FLAGS) {
+		add_parent_to_check(path_buff, &dirs_to_check, &num_dirs_to_check);
+	    } else if (!(eventFlags[i] & kFSEventStreamEventFlagItemIsDir)) {
+		execute_for_path(path_buff);
+	    }
+	    continue;
+	} else {
+	    recursive = 0;
+	}
+
+	//
+	// Now go update our state and print out the new size
+	// of the directory hierarchy we're watching.
+	//
+	if (recursive) {
+	    //
+	    // Only directories (and files) that changed since the last
+	    // batch need looking at, but that is still every directory
+	    // under path, so it is left to the scanner thread like a
+	    // scan.
+	    //
+	    queue_reconcile(path_buff, missed_since);
+	} else {
+	    check_children_of_dir(path_buff);
+	}
+//	printf("New total size: %lld (change made to: %s) for path: %s\n",
+//		get_total_size(), path_buff, full_path);
+    }
+    log_event_id = 0;
+
+    for(i=0; i < num_dirs_to_check; i++) {
+	check_children_of_dir(dirs_to_check[i]);
+	free(dirs_to_check[i]);
+    }
+    free(dirs_to_check);
+
+    //
+    // Anything that vanished during this batch and didn't turn up
+    // again under a new name is really gone.
+    //
+    discard_detached_dir_items();
+
+    run_skim_imports();
+    enforce_memory_budget();
+
+    trace(EVENT_BATCH_DONE, numEvents, numEvents ? eventIDs[0] : 0, numEvents ? eventIDs[numEvents-1] : 0,
+	  trace_usecs_since(trace_start));
+}
+
+
+
+//
+// Create (but don't start) the stream for settings->fullpath using
+// the current since_when, latency and flags.
+//
+FSEventStreamRef
+create_stream(settings_t *settings)
+{
+    FSEventStreamContext  context = {0, NULL, NULL, NULL, NULL};
+    FSEventStreamRef      stream_ref;
+    CFMutableArrayRef     cfarray_of_paths;
+
+    cfarray_of_paths = create_cfarray_from_path(settings->fullpath);
+    if (cfarray_of_paths == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "failed to create the array for: %s", settings->fullpath);
+	return NULL;
+    }
+
+    context.info = (void *)settings;
+    stream_ref = FSEventStreamCreate(kCFAllocatorDefault,
+				    (FSEventStreamCallback)&fsevents_callback,
+				    &context,
+				    cfarray_of_paths,
+				    settings->since_when,
+				    settings->latency,
+				    settings->file_events ? kFSEventStreamCreateFlagFileEvents
+							  : kFSEventStreamCreateFlagNone);
+//	                            kFSEventStreamCreateFlagWatchRoot);
+
+    CFRelease(cfarray_of_paths);
+    if (stream_ref == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "failed to create the stream for: %s", settings->fullpath);
+    }
+
+    return stream_ref;
+}
+
+
+static int
+watch_dir_hierarchy(settings_t *settings)
+{
+    FSEventStreamRef      stream_ref = NULL;
+    int                   ret = 0;
+    int                   need_initial_scan = 0;
+    int                   need_reconcile = 0;
+    struct stat           st;
+    struct timeval        start;
+    CFUUIDRef             uuid_ref;
+    char                  snapshot[MAXPATHLEN];
+    const char           *snapshot_name;
+
+    gettimeofday(&start, NULL);
+
+    //
+    // Figure out the device of the path we're watching and
+    // get its FSEventStream UUID.
+    //
+    if (get_dev_info(settings) != 0) {
+	return -1;
+    }
+    set_state_root(settings->fullpath);
+
+    //
+    // Try to load the stored stream info
+    //
+    if (load_stream_info(&settings->since_when, &uuid_ref) == 0) {
+	//
+	// If we loaded the stream info cleanly, check if the uuid's match.
+	//
+	if (CFEqual(uuid_ref, settings->dev_uuid)) {
+	    //
+	    // The uuid's matched so now load the stored state for
+	    // this hierarchy
+	    //
+	    if (load_dir_items("diritems.txt") == 0) {
+		log_msg(LOG_LEVEL_INFO, "Stored total size is: %lld for path: %s (since_when %lld)",
+		    get_total_size(), settings->fullpath, settings->since_when);
+	    } else {
+		settings->since_when = kFSEventStreamEventIdSinceNow;
+		need_initial_scan = 1;
+	    }
+	} else {
+	    //
+	    // The event history is no use to us, but the paths in the
+	    // stored state still are.  Check it against the disk for
+	    // anything that changed since it was saved.  The inode
+	    // numbers are from the old volume, so they mustn't be used
+	    // to match up renames until that is done.
+	    //
+	    log_msg(LOG_LEVEL_WARNING, "UUID mis-match!  Ditching stored history id %lld", settings->since_when);
+	    settings->since_when = kFSEventStreamEventIdSinceNow;
+	    if (stat("diritems.txt", &st) == 0 && load_dir_items("diritems.txt") == 0) {
+		last_sync_time = st.st_mtime;
+		set_stale_inodes(1);
+		need_reconcile = 1;
+	    } else {
+		need_initial_scan = 1;
+	    }
+	}
+
+	CFRelease(uuid_ref);
+
+    } else {
+	need_initial_scan = 1;
+    }
+
+    stream_ref = create_stream(settings);
+    if (stream_ref == NULL) {
+	CFRelease(settings->dev_uuid);
+	settings->dev_uuid = NULL;
+	return -1;
+    }
+
+    settings->stream_ref = stream_ref;
+
+    setup_run_loop_signal_handler(CFRunLoopGetCurrent(), settings);
+    setup_control_socket(CFRunLoopGetCurrent(), settings);
+
+    FSEventStreamScheduleWithRunLoop(stream_ref, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    if (!FSEventStreamStart(stream_ref)) {
+	log_msg(LOG_LEVEL_ERROR, "failed to start the FSEventStream");
+	ret = -1;
+	goto out;
+    }
+
+    set_scan_budget(settings->scan_ops_per_sec, settings->scan_bytes_per_sec);
+    set_memory_budget(settings->memory_budget, settings->evict_after);
+    enforce_memory_budget();
+    set_bulk_attrs(!settings->no_bulk_attrs);
+    set_skim_import(settings->import_skim, settings->import_jobs);
+    if (settings->import_skim) {
+	load_skim_sync_state("skim-sync.txt");
+    }
+    set_notes_index(settings->index_notes);
+    if (settings->index_notes) {
+	start_loading_notes_index("notes-index.txt");
+    }
+    set_group_commit(settings->group_commit);
+    start_conversion_workers(settings->convert_jobs);
+    load_conversion_queue("conversions.txt");
+    set_poll_interval(settings->poll_interval, settings->local_volume);
+
+    if (need_reconcile) {
+	// on the scanner thread, so that events are handled meanwhile
+	queue_reconcile(settings->fullpath, last_sync_time - RECONCILE_SLACK);
+    }
+    //
+    // Another machine may have done the scanning for us, but .skim
+    // files that came with the papers only turn up in a full scan.
+    //
+    if (need_initial_scan && !settings->import_skim
+	&& (snapshot_name = snapshot_path(settings, snapshot, sizeof(snapshot)))
+	&& import_snapshot(snapshot_name) == 0) {
+	log_msg(LOG_LEVEL_INFO, "Starting from %s in the background", snapshot_name);
+	need_initial_scan = 0;
+	last_sync_time = time(NULL);
+    }
+    if (need_initial_scan || need_reconcile) {
+	last_sync_time = time(NULL);
+    }
+
+    if (need_initial_scan) {
+	//
+	// NOTE: we get the initial size *after* we start the
+	//       FSEventStream so that there is no window
+	//       during which we would miss events.
+	//
+	scan_directory(settings->fullpath, 1, 1, 0);
+	if (scan_in_progress()) {
+	    log_msg(LOG_LEVEL_INFO, "Initial scan of %s continuing in the background", settings->fullpath);
+	} else {
+	    log_msg(LOG_LEVEL_INFO, "Initial total size is: %lld for path: %s", get_total_size(), settings->fullpath);
+	}
+    }
+
+
+    set_idle_exit(settings->idle_exit);
+    mark_ready(start.tv_sec + start.tv_usec / 1000000.0);
+
+    //
+    // Run, unless watcher_stop() got in first
+    //
+    if (!__atomic_load_n(&settings->context->stop_requested, __ATOMIC_ACQUIRE)) {
+	CFRunLoopRun();
+    }
+
+    set_idle_exit(0);
+
+    // a reload may have replaced the stream we started with
+    stream_ref = settings->stream_ref;
+
+    // Although it's not strictly necessary, make sure we see any pending events... 
+    FSEventStreamFlushSync(stream_ref);
+
+    set_poll_interval(0, 1);
+
+    //
+    // Only the batches the workers are on are finished; with a big
+    // backlog waiting for the rest would outlast launchd's patience,
+    // and then nothing below gets saved.
+    //
+    stop_conversion_workers();
+    save_conversion_queue("conversions.txt");
+    
+    FSEventStreamStop(stream_ref);
+
+  out:
+
+    //
+    // Save out information about the last event id and uuid for the
+    // the device we're watching.
+    //
+    save_stream_info(FSEventStreamGetLatestEventId(stream_ref), settings->dev_uuid);
+
+    //
+    // Save the directory item state.  If a throttled scan hasn't
+    // finished yet the state is incomplete, so throw it away and
+    // let the next run start from scratch.
+    //
+    if (scan_in_progress()) {
+	log_msg(LOG_LEVEL_WARNING, "scan still in progress, not saving directory state");
+	cancel_pending_scans();
+	unlink("diritems.txt");
+	unlink("diritems.txt.idx");
+    } else if (save_dir_items("diritems.txt") == 0
+	       && (snapshot_name = snapshot_path(settings, snapshot, sizeof(snapshot)))) {
+	export_snapshot("diritems.txt", snapshot_name);
+    }
+    stop_scanner();
+    if (settings->import_skim) {
+	save_skim_sync_state("skim-sync.txt");
+    }
+    set_notes_index(0);
+    close_notes_index();
+
+    //
+    // Invalidation and final shutdown of the stream
+    //
+    FSEventStreamInvalidate(stream_ref);
+    FSEventStreamRelease(stream_ref);
+
+    CFRelease(settings->dev_uuid);
+    settings->dev_uuid = NULL;
+
+    cleanup_control_socket(CFRunLoopGetCurrent());
+    cleanup_run_loop_signal_handler(CFRunLoopGetCurrent());
+    settings->stream_ref = NULL;
+
+    return ret;
+}
+
+
+//
+// Replace the running stream with one built from the current
+// settings, picking up where the old one left off so no events are
+// lost in between.
+//
+static int
+restart_stream(settings_t *settings)
+{
+    FSEventStreamRef old_ref = settings->stream_ref, new_ref;
+
+    FSEventStreamFlushSync(old_ref);
+    FSEventStreamStop(old_ref);
+
+    settings->since_when = FSEventStreamGetLatestEventId(old_ref);
+    if (settings->since_when == kFSEventStreamEventIdSinceNow || settings->since_when == 0) {
+	settings->since_when = FSEventsGetCurrentEventId();
+    }
+
+    //
+    // The old stream is only let go once the new one is running, so
+    // that if anything goes wrong we can keep going with what we had.
+    //
+    new_ref = create_stream(settings);
+    if (new_ref != NULL) {
+	FSEventStreamScheduleWithRunLoop(new_ref, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+	if (!FSEventStreamStart(new_ref)) {
+	    log_msg(LOG_LEVEL_ERROR, "failed to start the new FSEventStream, keeping the old one");
+	    FSEventStreamInvalidate(new_ref);
+	    FSEventStreamRelease(new_ref);
+	    new_ref = NULL;
+	}
+    }
+    if (new_ref == NULL) {
+	FSEventStreamStart(old_ref);
+	return -1;
+    }
+
+    FSEventStreamInvalidate(old_ref);
+    FSEventStreamRelease(old_ref);
+    settings->stream_ref = new_ref;
+
+    return 0;
+}
+
+
+static void
+swap_root(settings_t *a, settings_t *b)
+{
+    settings_t tmp;
+
+    tmp.dev          = a->dev;
+    tmp.dev_uuid     = a->dev_uuid;
+    tmp.local_volume = a->local_volume;
+    strlcpy(tmp.mount_point, a->mount_point, sizeof(tmp.mount_point));
+    strlcpy(tmp.root, a->root, sizeof(tmp.root));
+
+    a->dev          = b->dev;
+    a->dev_uuid     = b->dev_uuid;
+    a->local_volume = b->local_volume;
+    strlcpy(a->mount_point, b->mount_point, sizeof(a->mount_point));
+    strlcpy(a->root, b->root, sizeof(a->root));
+    a->fullpath = a->root;
+
+    b->dev          = tmp.dev;
+    b->dev_uuid     = tmp.dev_uuid;
+    b->local_volume = tmp.local_volume;
+    strlcpy(b->mount_point, tmp.mount_point, sizeof(b->mount_point));
+    strlcpy(b->root, tmp.root, sizeof(b->root));
+    b->fullpath = b->root;
+}
+
+
+//
+// Called on SIGHUP.  Re-read the options and config file and
+// apply whatever changed without throwing away the directory state:
+// the budgets are just updated, a new latency or event mode only
+// needs a new stream, and only a new root has to be scanned again.
+//
+void
+reload_settings(settings_t *settings)
+{
+    settings_t _new_settings, *new_settings = &_new_settings;
+    int        new_stream;
+
+    init_settings(settings->context, new_settings);
+    if (new_settings->config_file && load_config_file(new_settings->config_file, new_settings) != 0) {
+	log_msg(LOG_LEVEL_WARNING, "reload: can't read %s, keeping the current settings", new_settings->config_file);
+	return;
+    }
+    if (new_settings->fullpath == NULL) {
+	log_msg(LOG_LEVEL_WARNING, "reload: no path to watch, keeping the current settings");
+	return;
+    }
+    resolve_root(new_settings->fullpath, new_settings->root, sizeof(new_settings->root));
+    new_settings->fullpath = new_settings->root;
+
+    settings->scan_ops_per_sec   = new_settings->scan_ops_per_sec;
+    settings->scan_bytes_per_sec = new_settings->scan_bytes_per_sec;
+    set_scan_budget(settings->scan_ops_per_sec, settings->scan_bytes_per_sec);
+
+    settings->memory_budget = new_settings->memory_budget;
+    settings->evict_after   = new_settings->evict_after;
+    set_memory_budget(settings->memory_budget, settings->evict_after);
+    enforce_memory_budget();
+
+    settings->no_bulk_attrs = new_settings->no_bulk_attrs;
+    set_bulk_attrs(!settings->no_bulk_attrs);
+
+    settings->poll_interval = new_settings->poll_interval;
+    set_poll_interval(settings->poll_interval, settings->local_volume);
+
+    settings->idle_exit = new_settings->idle_exit;
+    set_idle_exit(settings->idle_exit);
+
+    settings->log_level = new_settings->log_level;
+    log_level = settings->log_level;
+
+    if (new_settings->import_skim && !settings->import_skim) {
+	load_skim_sync_state("skim-sync.txt");
+    }
+    settings->import_skim = new_settings->import_skim;
+    settings->import_jobs = new_settings->import_jobs;
+    set_skim_import(settings->import_skim, settings->import_jobs);
+
+    settings->group_commit = new_settings->group_commit;
+    set_group_commit(settings->group_commit);
+
+    // only used when saving and starting up
+    strlcpy(settings->snapshot_name, new_settings->snapshot_name, sizeof(settings->snapshot_name));
+    settings->snapshot_file = new_settings->snapshot_file ? settings->snapshot_name : NULL;
+
+    if (new_settings->index_notes != settings->index_notes) {
+	if (new_settings->index_notes && load_notes_index("notes-index.txt", 1) != 0) {
+	    log_msg(LOG_LEVEL_WARNING, "reload: can't open notes-index.txt (%s)", strerror(errno));
+	} else {
+	    settings->index_notes = new_settings->index_notes;
+	    set_notes_index(settings->index_notes);
+	    if (!settings->index_notes) {
+		close_notes_index();
+	    }
+	}
+    }
+
+    new_stream = (settings->latency != new_settings->latency
+		  || settings->file_events != new_settings->file_events);
+    settings->latency     = new_settings->latency;
+    settings->file_events = new_settings->file_events;
+
+    if (strcmp(new_settings->root, settings->fullpath) != 0) {
+	if (get_dev_info(new_settings) != 0) {
+	    log_msg(LOG_LEVEL_WARNING, "reload: can't watch %s, still watching %s", new_settings->root, settings->fullpath);
+	} else {
+	    log_msg(LOG_LEVEL_INFO, "reload: now watching %s instead of %s", new_settings->root, settings->fullpath);
+
+	    cancel_pending_scans();
+	    discard_all_dir_items();
+
+	    // swap the new root in, keeping the old one in new_settings in case the stream fails
+	    swap_root(settings, new_settings);
+	    if (restart_stream(settings) != 0) {
+		log_msg(LOG_LEVEL_WARNING, "reload: going back to %s", new_settings->root);
+		swap_root(settings, new_settings);
+	    }
+	    CFRelease(new_settings->dev_uuid);
+	    set_state_root(settings->fullpath);
+	    set_poll_interval(settings->poll_interval, settings->local_volume);
+
+	    scan_directory(settings->fullpath, 1, 1, 0);
+	    return;
+	}
+    }
+
+    if (new_stream) {
+	restart_stream(settings);
+    }
+
+    log_msg(LOG_LEVEL_INFO, "reload: latency %g, file events %s, scan budget %g ops/%g bytes, memory budget %lld",
+	    settings->latency, settings->file_events ? "on" : "off", settings->scan_ops_per_sec,
+	    settings->scan_bytes_per_sec, (long long)settings->memory_budget);
+}
+
+void
+resolve_root(const char *name, char *fullpath, size_t size)
+{
+    char path[PATH_MAX];
+
+    // name may point at fullpath (when it came from the config file)
+    strlcpy(path, name, sizeof(path));
+
+    if (realpath(path, fullpath) == NULL) {
+	if (path[0] != '/') {
+	    int len;
+	    
+	    getcwd(fullpath, size);
+	    len = strlen(fullpath);
+	    fullpath[len] = '/';
+	    strlcpy(&fullpath[len+1], path, size - (len+1));
+	} else {
+	    strlcpy(fullpath, path, size);
+	}
+    }
+}
+
+
+//
+//--------------------------------------------------------------------------------
+//
+
+int
+get_dev_info(settings_t *settings)
+{
+    struct stat st;
+    dev_t       dev = 0;
+    struct statfs sfs;
+    char        path[MAXPATHLEN];
+
+    settings->dev = 0;
+    settings->mount_point[0] = '\0';
+
+    strlcpy(path, settings->fullpath, sizeof(path));
+
+    do {
+	if (lstat(path, &st) == 0) {
+	    dev = st.st_dev;
+	} else {
+	    char *ptr;
+
+	    ptr = strrchr(path, '/');
+	    if (ptr) {
+		*ptr = '\0';
+	    } else {
+		path[0] = '\0';
+	    }
+	}
+	
+    } while(dev == 0 && path[0] != '\0');
+
+    if (path[0] == '\0') {
+	return -1;
+    }
+
+    settings->dev = dev;
+    settings->dev_uuid = FSEventsCopyUUIDForDevice(settings->dev);
+    if (settings->dev_uuid == NULL) {
+	return -1;
+    }
+
+    if (statfs(path, &sfs) == 0) {
+	strlcpy(settings->mount_point, sfs.f_mntonname, sizeof(settings->mount_point));
+	settings->local_volume = (sfs.f_flags & MNT_LOCAL) != 0;
+    } else {
+	CFRelease(settings->dev_uuid);
+	settings->dev_uuid = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+//
+//--------------------------------------------------------------------------------
+//
+
+#define STREAM_INFO_NAME  "stream-info.txt"
+
+void
+save_stream_info(uint64_t last_id, CFUUIDRef uuid_ref)
+{
+    FILE *fp;
+    CFStringRef cfstr;
+    char uuid_str[64];
+
+    fp = fopen(STREAM_INFO_NAME, "w");
+    if (fp) {
+	if (last_id == kFSEventStreamEventIdSinceNow || last_id == 0) {
+	    last_id = FSEventsGetCurrentEventId();
+	}
+	log_msg(LOG_LEVEL_INFO, "saving state: last_id %lld", last_id);
+
+	fprintf(fp, "%lld\n", last_id);
+
+	cfstr = CFUUIDCreateString(NULL, uuid_ref);
+	if (cfstr && CFStringGetCString(cfstr, uuid_str, sizeof(uuid_str), kCFStringEncodingUTF8)) {
+	    fprintf(fp, "%s\n", uuid_str);
+	} else {
+	    fprintf(fp, "unknown-uuid\n");
+	}
+	fclose(fp);
+
+	if (cfstr) {
+	    CFRelease(cfstr);
+	}
+    }
+}
+
+
+int
+load_stream_info(uint64_t *since_when, CFUUIDRef *uuid_ref_ptr)
+{
+    FILE *fp;
+    char uuid_str[64];
+    CFStringRef cfstr;
+    int ret=ENOMEM;
+
+    fp = fopen(STREAM_INFO_NAME, "r");
+    if (fp == NULL) {
+	return ENOENT;
+    }
+    
+    if (fscanf(fp, "%lld\n", since_when) != 1) {
+	log_msg(LOG_LEVEL_ERROR, "error getting last id.");
+	*since_when = kFSEventStreamEventIdSinceNow;
+    }
+
+    fscanf(fp, "%s\n", uuid_str);
+    cfstr = CFStringCreateWithCString(NULL, uuid_str, kCFStringEncodingUTF8);
+    if (cfstr) {
+	*uuid_ref_ptr = CFUUIDCreateFromString(NULL, cfstr);
+	if (*uuid_ref_ptr == NULL) {
+	    log_msg(LOG_LEVEL_ERROR, "failed to create the dev uuid from str: %s", uuid_str);
+	    *since_when = kFSEventStreamEventIdSinceNow;
+	    ret = EINVAL;
+	} else {
+	    ret = 0;
+	}
+	
+	CFRelease(cfstr);
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+
+//
+// Options that can be given either on the command line (with a
+// leading '-') or in the config file.  Returns 1 if the value was
+// used, 0 if the option doesn't take one and -1 if it isn't known.
+//
+static int
+parse_option(const char *name, const char *value, settings_t *settings)
+{
+    int level;
+
+    if (strcmp(name, "fileEvents") == 0) {
+	settings->file_events = 1;
+	return 0;
+    } else if (strcmp(name, "noBulkAttrs") == 0) {
+	settings->no_bulk_attrs = 1;
+	return 0;
+    } else if (strcmp(name, "importSkim") == 0) {
+	settings->import_skim = 1;
+	return 0;
+    } else if (strcmp(name, "logJSON") == 0) {
+	settings->log_json = 1;
+	return 0;
+    } else if (strcmp(name, "indexNotes") == 0) {
+	settings->index_notes = 1;
+	return 0;
+    }
+
+    if (value == NULL) {
+	return -1;
+    }
+
+    if (strcmp(name, "path") == 0) {
+	strlcpy(settings->root, value, sizeof(settings->root));
+	settings->fullpath = settings->root;
+    } else if (strcmp(name, "sinceWhen") == 0 || strcmp(name, "since_when") == 0) {
+	// since_when is what the tool used to take
+	settings->since_when = strtoull(value, NULL, 0);
+    } else if (strcmp(name, "latency") == 0) {
+	settings->latency = strtod(value, NULL);
+    } else if (strcmp(name, "scanOps") == 0) {
+	settings->scan_ops_per_sec = strtod(value, NULL);
+    } else if (strcmp(name, "scanBytes") == 0) {
+	settings->scan_bytes_per_sec = strtod(value, NULL);
+    } else if (strcmp(name, "memBudget") == 0) {
+	settings->memory_budget = strtoll(value, NULL, 0);
+    } else if (strcmp(name, "evictAfter") == 0) {
+	settings->evict_after = strtod(value, NULL);
+    } else if (strcmp(name, "poll") == 0) {
+	settings->poll_interval = strtod(value, NULL);
+    } else if (strcmp(name, "idleExit") == 0) {
+	settings->idle_exit = strtod(value, NULL);
+    } else if (strcmp(name, "importJobs") == 0) {
+	settings->import_jobs = strtol(value, NULL, 0);
+    } else if (strcmp(name, "convertJobs") == 0) {
+	settings->convert_jobs = strtol(value, NULL, 0);
+    } else if (strcmp(name, "groupCommit") == 0) {
+	settings->group_commit = strtol(value, NULL, 0);
+    } else if (strcmp(name, "logLevel") == 0) {
+	if ((level = log_level_from_name(value)) < 0) {
+	    log_msg(LOG_LEVEL_WARNING, "unknown log level \"%s\"", value);
+	} else {
+	    settings->log_level = level;
+	}
+    } else if (strcmp(name, "logFile") == 0) {
+	// value may be a config file line that is about to be reused
+	strlcpy(settings->log_path, value, sizeof(settings->log_path));
+	settings->log_file = settings->log_path;
+    } else if (strcmp(name, "snapshot") == 0) {
+	strlcpy(settings->snapshot_name, value, sizeof(settings->snapshot_name));
+	settings->snapshot_file = settings->snapshot_name;
+    } else {
+	return -1;
+    }
+
+    return 1;
+}
+
+
+//
+// The defaults, with whatever was given to watcher_set_option() on top.
+//
+void
+init_settings(watcher_context *ctx, settings_t *settings)
+{
+    int i;
+
+    memset(settings, 0, sizeof(settings_t));
+
+    settings->since_when = kFSEventStreamEventIdSinceNow;
+    settings->latency = 0.5;
+    settings->evict_after = 3600;
+    settings->poll_interval = -1;
+    settings->import_jobs = 4;
+    settings->convert_jobs = 2;
+    settings->group_commit = 32;
+    settings->log_level = LOG_LEVEL_INFO;
+    settings->context = ctx;
+    settings->config_file = ctx->config_file;
+
+    for(i=0; i < ctx->num_options; i++) {
+        parse_option(ctx->option_names[i], ctx->option_values[i], settings);
+    }
+}
+
+
+//
+// The config file holds one option per line, named as on the command
+// line but without the '-', e.g. "latency 2.0".  "path <dir>" gives
+// the hierarchy to watch.  Blank lines and lines starting with '#'
+// are ignored.  Anything given on the command line wins over the file.
+//
+int
+load_config_file(const char *name, settings_t *settings)
+{
+    FILE       *fp;
+    char        line[PATH_MAX+64], *opt, *value, *end;
+    int         i, lineno = 0;
+
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+	return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	lineno++;
+
+	opt = line + strspn(line, " \t");
+	end = opt + strlen(opt);
+	while (end > opt && isspace((unsigned char)end[-1])) {
+	    *--end = '\0';
+	}
+	if (*opt == '\0' || *opt == '#') {
+	    continue;
+	}
+
+	value = opt + strcspn(opt, " \t");
+	if (*value != '\0') {
+	    *value++ = '\0';
+	    value += strspn(value, " \t");
+	} else {
+	    value = NULL;
+	}
+
+	if (parse_option(opt, value, settings) < 0) {
+	    log_msg(LOG_LEVEL_WARNING, "%s:%d: unknown option \"%s\"", name, lineno, opt);
+	}
+    }
+    fclose(fp);
+
+    // put back whatever was set directly
+    for(i=0; i < settings->context->num_options; i++) {
+	parse_option(settings->context->option_names[i], settings->context->option_values[i], settings);
+    }
+
+    return 0;
+}
+
+
+//
+//--------------------------------------------------------------------------------
+//  Simple wrapper to create a CFArray that contains a single
+//  CFString in it (in this program it's the path we want to
+//  watch).
+//
+//
+
+CFMutableArrayRef
+create_cfarray_from_path(const char *path)
+{
+    CFMutableArrayRef cfArray;
+
+    cfArray = CFArrayCreateMutable(kCFAllocatorDefault, 1, &kCFTypeArrayCallBacks);
+    if (cfArray == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "%s: CFArrayCreateMutable() => NULL", __func__);
+	return NULL;
+    }
+
+    CFStringRef cfStr = CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
+    if (cfStr == NULL) {
+	CFRelease(cfArray);
+	return NULL;
+    }
+
+    CFArraySetValueAtIndex(cfArray, 0, cfStr);
+    CFRelease(cfStr);
+ 	
+    return cfArray;
+}
+
+
+//
+//--------------------------------------------------------------------------------
+// Routines to keep track of the size of the directory hierarchy 
+// we are watching.
+//
+// This code is not exemplary in any way.  It works but is
+// probably not the best way to keep track of directory
+// state.
+//
+
+typedef struct dir_item {
+    char       *dirname;
+    short int   depth;
+    short int   state;
+    short int   flags;
+    short int   poll_level;    // see "polling"
+    off_t       size;
+    ino_t       ino;
+    time_t      mtime;
+    time_t      last_used;
+    time_t      polled;        // when it was last looked at by polling
+} dir_item;
+
+#define DIR_ITEM_EVICTED  0x0001     // children live in the eviction file
+
+//
+// The items are split into NUM_DIR_SHARDS shards by the top-level
+// directory (the first component below the root) they live under,
+// so that the scanner thread working through one part of the tree
+// doesn't hold up live events in another.  Each shard is a sorted
+// array of items with its own lock.  Since a directory's children
+// sort straight after it, the subtree of anything below the root is
+// a contiguous run within a single shard.  The root itself is kept
+// in shard 0, and its subtree is all of them.
+//
+// Locks are taken in this order: shards (lowest index first), then
+// detached_lock, then evicted_lock.  Functions that are handed a
+// dir_shard expect the caller to hold its lock, for writing unless
+// they only look.
+//
+#define NUM_DIR_SHARDS  16
+
+typedef struct dir_shard {
+    pthread_rwlock_t  lock;
+    dir_item         *dir_items;
+    int               num_dir_items;
+    int               max_dir_items;
+    int               unsorted;       // added to since it was last sorted
+} dir_shard;
+
+dir_shard       dir_shards[NUM_DIR_SHARDS];
+pthread_once_t  dir_shards_once = PTHREAD_ONCE_INIT;
+__thread int    shards_held=0;              // see charge_scan_budget()
+__thread int    scan_debt_deferred=0;
+char            state_root[MAXPATHLEN];     // what the top level is below
+size_t          state_root_len=0;
+
+//
+// Subtrees that disappeared from their parent during the current
+// batch of events.  They are kept around (instead of being freed
+// straight away) so that if the same directory shows up somewhere
+// else in the batch -- i.e. it was renamed or moved -- we can just
+// re-parent the stored state instead of rescanning everything
+// underneath it.  Whatever is left over at the end of the batch
+// really was deleted.
+//
+dir_item        *detached_items=NULL;
+int              num_detached_items=0;
+int              max_detached_items=0;
+pthread_mutex_t  detached_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Set while the stored inode numbers are from another volume (see
+// watch_dir_hierarchy()), so that renames aren't matched up by them
+// until reconcile_dir_items() has seen every directory again.
+//
+int              stale_inodes=0;
+
+#define DIR_ITEM_INCR  128
+
+#define DIR_ITEMS_VERSION  4
+
+//
+// Subtrees that haven't seen any activity for a while can be written
+// out to EVICTED_ITEMS_NAME to keep memory use under a budget.  The
+// top directory of each one stays in its shard (flagged as evicted)
+// and the rest is read back the first time anything underneath it is
+// looked at.  Entries are keyed by the inode of the top directory so
+// that they survive it being renamed.
+//
+// The same mechanism is used to load saved state lazily at startup:
+// only the top-level directories are read from the index, and each
+// subtree's records stay in the saved file until they are needed.
+//
+// Records that have been read back are dead weight in the file.  Once
+// they are most of it (and more than EVICTED_COMPACT_MIN) the live
+// ones are copied to a fresh file, so that subtrees going back and
+// forth (polling faults cold ones in every so often) don't make it
+// grow without end.
+//
+#define EVICTED_ITEMS_NAME  "diritems-evicted.txt"
+#define EVICTED_COMPACT_MIN (1024*1024)
+#define DIR_INDEX_VERSION   1
+
+typedef struct evicted_subtree {
+    ino_t   ino;           // of the top directory, which stays resident
+    char   *dirname;       // its name and depth when it was evicted
+    int     depth;
+    FILE   *fp;            // file holding its children, in write_dir_item() format
+    int     version;       // ... of this version
+    off_t   offset;        // where its children start in the file
+    off_t   length;        // and how many bytes of it they take
+    int     count;
+    off_t   size;          // total size of its children
+} evicted_subtree;
+
+evicted_subtree *evicted=NULL;
+int              num_evicted=0;
+int              max_evicted=0;
+FILE            *evicted_fp=NULL;
+off_t            evicted_dead=0;       // bytes of evicted_fp nothing refers to any more
+FILE            *snapshot_fp=NULL;     // saved state not loaded yet
+pthread_mutex_t  evicted_lock = PTHREAD_MUTEX_INITIALIZER;   // and the two files
+
+off_t            memory_budget=0;      // 0 means unlimited
+double           evict_after=3600;
+uint64_t         state_hits=0;
+uint64_t         state_misses=0;
+
+#define FNV_OFFSET_BASIS       0xcbf29ce484222325ULL
+#define FNV_PRIME              0x100000001b3ULL
+
+static uint64_t
+fnv1a_hash(const void *data, size_t len, uint64_t hash)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+
+    while (len-- > 0) {
+	hash ^= *ptr++;
+	hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+//
+// Like strcmp() except that '/' sorts before every other character.
+// That keeps a directory's children immediately after it in the
+// sorted list ("a/b", "a/b/c", "a/b c" rather than "a/b", "a/b c",
+// "a/b/c"), which the subtree walks below depend on.
+//
+static int
+compare_paths(const char *a, const char *b)
+{
+    for(; *a && *a == *b; a++, b++)
+	;
+
+    if (*a == *b) {
+	return 0;
+    } else if (*a == '/') {
+	return (*b == '\0') ? 1 : -1;
+    } else if (*b == '/') {
+	return (*a == '\0') ? -1 : 1;
+    }
+
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+
+static int
+compare_dir_items(const void *_a, const void *_b)
+{
+    dir_item *a = (dir_item *)_a, *b = (dir_item *)_b;
+
+    if (a->dirname == NULL) {
+	if (b->dirname == NULL) {
+	    return 0;
+	}
+	return 1;
+    } else if (b->dirname == NULL) {
+	return -1;
+    }
+
+    return compare_paths(a->dirname, b->dirname);
+}
+
+
+static int
+grow_dir_items(dir_item **items, int num, int *max)
+{
+    if (num+1 >= *max) {
+	dir_item *new;
+
+	new = (dir_item *)realloc(*items, (*max+DIR_ITEM_INCR)*sizeof(dir_item));
+	if (new == NULL) {
+	    return ENOSPC;
+	}
+	*items = new;
+	*max += DIR_ITEM_INCR;
+    }
+
+    return 0;
+}
+
+
+static void
+init_dir_shards(void)
+{
+    int s;
+
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	pthread_rwlock_init(&dir_shards[s].lock, NULL);
+    }
+}
+
+
+//
+// Paths are sharded by the directory they are under just below
+// root, so this has to be set before anything is added.
+//
+void
+set_state_root(const char *root)
+{
+    pthread_once(&dir_shards_once, init_dir_shards);
+
+    strlcpy(state_root, root, sizeof(state_root));
+    state_root_len = strlen(state_root);
+    while (state_root_len > 0 && state_root[state_root_len-1] == '/') {
+	state_root_len--;
+    }
+}
+
+
+static int
+is_state_root(const char *path)
+{
+    return strcmp(path, state_root) == 0;
+}
+
+
+// the shard that path itself lives in
+static dir_shard *
+path_shard(const char *path)
+{
+    const char *top, *end;
+    size_t      len;
+
+    if (strncmp(path, state_root, state_root_len) != 0 || path[state_root_len] != '/') {
+	return &dir_shards[0];
+    }
+
+    top = &path[state_root_len+1];
+    end = strchr(top, '/');
+    len = end ? (size_t)(end - top) : strlen(top);
+
+    return &dir_shards[fnv1a_hash(top, len, FNV_OFFSET_BASIS) % NUM_DIR_SHARDS];
+}
+
+
+static void
+cleanup_dir_items(dir_shard *shard)
+{
+    int i;
+
+    //
+    // resort the list and then cleanup any dead guys.
+    //
+    if (shard->num_dir_items > 1) {
+	qsort(shard->dir_items, shard->num_dir_items, sizeof(dir_item), compare_dir_items);
+    }
+    shard->unsorted = 0;
+
+    for(i=shard->num_dir_items-1; i >= 0; i--) {
+	if (shard->dir_items[i].dirname == NULL) {
+	    shard->num_dir_items--;
+	}
+    }
+}
+
+
+//
+// Shards locked for writing get sorted (if they need it) so that
+// subtree walks work.
+//
+static void
+lock_dir_shard(dir_shard *shard, int write)
+{
+    pthread_once(&dir_shards_once, init_dir_shards);
+
+    shards_held++;
+    if (write) {
+	pthread_rwlock_wrlock(&shard->lock);
+	if (shard->unsorted) {
+	    cleanup_dir_items(shard);
+	}
+    } else {
+	pthread_rwlock_rdlock(&shard->lock);
+    }
+}
+
+
+static void
+unlock_dir_shard(dir_shard *shard)
+{
+    pthread_rwlock_unlock(&shard->lock);
+    if (--shards_held == 0 && scan_debt_deferred) {
+	pay_scan_debt();
+    }
+}
+
+
+//
+// Lock the shards that can hold path or anything underneath it:
+// just its own one, or all of them for the root.
+//
+static void
+lock_dir_shards(const char *path, int write, int *first, int *last)
+{
+    int s;
+
+    if (path == NULL || is_state_root(path)) {
+	*first = 0;
+	*last  = NUM_DIR_SHARDS-1;
+    } else {
+	*first = *last = path_shard(path) - dir_shards;
+    }
+
+    for(s=*first; s <= *last; s++) {
+	lock_dir_shard(&dir_shards[s], write);
+    }
+}
+
+
+static void
+unlock_dir_shards(int first, int last)
+{
+    int s;
+
+    for(s=last; s >= first; s--) {
+	unlock_dir_shard(&dir_shards[s]);
+    }
+}
+
+
+static int
+find_dir_item(dir_shard *shard, const char *name)
+{
+    int i;
+
+    for(i=0; i < shard->num_dir_items; i++) {
+	if (shard->dir_items[i].dirname != NULL && strcmp(name, shard->dir_items[i].dirname) == 0) {
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+
+//
+// Set start and end to the run of items in a (sorted) shard that
+// are path or underneath it, and return the index of path itself.
+// For the root that's everything, even in the shards it isn't in.
+//
+static int
+subtree_range(dir_shard *shard, const char *path, int *start, int *end)
+{
+    int i, idx;
+
+    idx = find_dir_item(shard, path);
+    if (idx < 0) {
+	*start = 0;
+	*end   = is_state_root(path) ? shard->num_dir_items : 0;
+	return -1;
+    }
+
+    for(i=idx+1; i < shard->num_dir_items && shard->dir_items[i].depth > shard->dir_items[idx].depth; i++)
+	;
+
+    *start = idx;
+    *end   = i;
+    return idx;
+}
+
+
+static dir_item *
+add_dir_item(dir_shard *shard, const char *name, off_t size, int depth, ino_t ino, time_t mtime)
+{
+    dir_item *item;
+
+    if (grow_dir_items(&shard->dir_items, shard->num_dir_items, &shard->max_dir_items) != 0) {
+	return NULL;
+    }
+
+    item = &shard->dir_items[shard->num_dir_items];
+    item->dirname   = strdup(name);
+    item->depth     = depth;
+    item->state     = 0;
+    item->flags     = 0;
+    item->poll_level = 0;
+    item->size      = size;
+    item->ino       = ino;
+    item->mtime     = mtime;
+    item->last_used = time(NULL);
+    item->polled    = item->last_used;
+
+    shard->num_dir_items++;
+    shard->unsorted = 1;
+    return item;
+}
+
+
+static void
+write_dir_item(FILE *fp, const dir_item *item, const char *name)
+{
+    fprintf(fp, "%d %lld %llu %ld %d %ld %ld %s\n", (int)item->depth, (long long)item->size,
+	    (unsigned long long)item->ino, (long)item->mtime, (int)item->poll_level,
+	    (long)item->last_used, (long)item->polled, name);
+}
+
+
+//
+// Parse one line written by write_dir_item() (or by an older version
+// of it).  Returns a pointer to the path within buff, or NULL if the
+// line is malformed.  The path is the rest of the line so that names
+// containing spaces survive a save/load cycle.
+//
+static char *
+parse_dir_item(char *buff, int version, dir_item *item)
+{
+    int                len, off = 0, depth, poll_level = 0;
+    long long          size;
+    unsigned long long ino = 0;
+    long               mtime = 0, last_used = 0, polled = 0;
+
+    len = strlen(buff);
+    if (len > 0 && buff[len-1] == '\n') {
+	buff[--len] = '\0';
+    }
+
+    if (version >= 4) {
+	if (sscanf(buff, "%d %lld %llu %ld %d %ld %ld %n", &depth, &size, &ino, &mtime,
+		   &poll_level, &last_used, &polled, &off) != 7) {
+	    return NULL;
+	}
+    } else if (version >= 3) {
+	if (sscanf(buff, "%d %lld %llu %ld %n", &depth, &size, &ino, &mtime, &off) != 4) {
+	    return NULL;
+	}
+    } else if (version >= 2) {
+	if (sscanf(buff, "%d %lld %llu %n", &depth, &size, &ino, &off) != 3) {
+	    return NULL;
+	}
+    } else if (sscanf(buff, "%d %lld %n", &depth, &size, &off) != 2) {
+	return NULL;
+    }
+
+    memset(item, 0, sizeof(dir_item));
+    item->depth = depth;
+    item->size  = size;
+    item->ino   = (ino_t)ino;
+    item->mtime = (time_t)mtime;
+    item->poll_level = poll_level;
+    item->last_used  = (time_t)last_used;
+    item->polled     = (time_t)polled;
+
+    return &buff[off];
+}
+
+
+//
+// The evicted list and its files are only touched with evicted_lock
+// held.
+//
+static evicted_subtree *
+find_evicted(ino_t ino)
+{
+    int i;
+
+    for(i=0; i < num_evicted; i++) {
+	if (evicted[i].ino == ino) {
+	    return &evicted[i];
+	}
+    }
+
+    return NULL;
+}
+
+
+static evicted_subtree *
+alloc_evicted(void)
+{
+    evicted_subtree *e;
+
+    if (num_evicted >= max_evicted) {
+	e = realloc(evicted, (max_evicted + DIR_ITEM_INCR) * sizeof(evicted_subtree));
+	if (e == NULL) {
+	    return NULL;
+	}
+	evicted = e;
+	max_evicted += DIR_ITEM_INCR;
+    }
+
+    e = &evicted[num_evicted];
+    memset(e, 0, sizeof(evicted_subtree));
+    return e;
+}
+
+
+static void
+forget_evicted(ino_t ino)
+{
+    evicted_subtree *e = find_evicted(ino);
+
+    if (e) {
+	if (e->fp == evicted_fp) {
+	    evicted_dead += e->length;
+	}
+	free(e->dirname);
+	*e = evicted[--num_evicted];
+    }
+}
+
+
+//
+// Read back the children of an evicted subtree one at a time.  The
+// stored paths and depths are rebased onto wherever the top directory
+// (stub) lives now.  Returns 0 and fills in item/name for each record.
+//
+static int
+read_evicted_record(evicted_subtree *e, const dir_item *stub, dir_item *item, char *name, size_t name_len)
+{
+    char    buff[MAXPATHLEN+64], *path;
+    size_t  old_len = strlen(e->dirname);
+
+    if (fgets(buff, sizeof(buff), e->fp) == NULL) {
+	return -1;
+    }
+    path = parse_dir_item(buff, e->version, item);
+    if (path == NULL || strncmp(path, e->dirname, old_len) != 0) {
+	return -1;
+    }
+
+    snprintf(name, name_len, "%s%s", stub->dirname, &path[old_len]);
+    item->depth = stub->depth + (item->depth - e->depth);
+    return 0;
+}
+
+
+// with every shard and evicted_lock held
+static void
+free_all_dir_items(void)
+{
+    dir_shard *shard;
+    int        s, i;
+
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	shard = &dir_shards[s];
+	for(i=0; i < shard->num_dir_items; i++) {
+	    if (shard->dir_items[i].dirname) {
+		free(shard->dir_items[i].dirname);
+		shard->dir_items[i].dirname = NULL;
+	    }
+
+	    shard->dir_items[i].size = 0;
+	}
+
+	shard->num_dir_items = 0;
+	shard->unsorted = 0;
+    }
+
+    while (num_evicted > 0) {
+	free(evicted[--num_evicted].dirname);
+    }
+
+    // nothing in it is wanted any more; the next eviction starts afresh
+    if (evicted_fp) {
+	fclose(evicted_fp);
+	evicted_fp = NULL;
+	evicted_dead = 0;
+    }
+}
+
+
+void
+discard_all_dir_items(void)
+{
+    int first, last;
+
+    lock_dir_shards(NULL, 1, &first, &last);
+    pthread_mutex_lock(&evicted_lock);
+
+    free_all_dir_items();
+
+    pthread_mutex_unlock(&evicted_lock);
+    unlock_dir_shards(first, last);
+}
+
+
+// fixed width, so that it can be rewritten in place once the size is known
+static void
+write_index_header(FILE *idx_fp, off_t data_size)
+{
+    fprintf(idx_fp, "# diritems-index %d %d %020lld\n", DIR_INDEX_VERSION, DIR_ITEMS_VERSION,
+	    (long long)data_size);
+}
+
+
+//
+// Finish off one entry of the index written alongside the saved
+// items: a top-level directory plus where its children are.
+//
+static void
+write_index_entry(FILE *idx_fp, const dir_item *top, off_t offset, int count, off_t size)
+{
+    if (top) {
+	fprintf(idx_fp, "%lld %d %lld ", (long long)offset, count, (long long)size);
+	write_dir_item(idx_fp, top, top->dirname);
+    }
+}
+
+
+//
+// The items are written to name and an index of the top-level
+// directories to name.idx, so that the next run can start with just
+// the index and load the rest on demand.  Both are written to
+// temporary files first since unloaded subtrees are copied out of
+// the current name.  The file goes shard by shard; within each one
+// every top-level directory is still followed by its children.
+//
+int
+save_dir_items(const char *name)
+{
+    int i, j, s, first, last, count = 0;
+    FILE *fp, *idx_fp;
+    evicted_subtree *e;
+    dir_item item, *items;
+    const dir_item *top = NULL;
+    off_t offset = 0, size = 0;
+    char path[MAXPATHLEN], tmp_name[MAXPATHLEN], idx_name[MAXPATHLEN], tmp_idx_name[MAXPATHLEN];
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.new", name);
+    snprintf(idx_name, sizeof(idx_name), "%s.idx", name);
+    snprintf(tmp_idx_name, sizeof(tmp_idx_name), "%s.idx.new", name);
+
+    fp = fopen(tmp_name, "w");
+    if (fp == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "can't create %s", tmp_name);
+	return -1;
+    }
+    idx_fp = fopen(tmp_idx_name, "w");
+    if (idx_fp == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "can't create %s", tmp_idx_name);
+	fclose(fp);
+	return -1;
+    }
+
+    lock_dir_shards(NULL, 1, &first, &last);
+    pthread_mutex_lock(&evicted_lock);
+
+    fprintf(fp, "# diritems %d\n", DIR_ITEMS_VERSION);
+    write_index_header(idx_fp, 0);
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	items = dir_shards[s].dir_items;
+
+	for(i=0; i < dir_shards[s].num_dir_items; i++) {
+	    if (items[i].dirname == NULL) {
+		continue;
+	    }
+
+	    write_dir_item(fp, &items[i], items[i].dirname);
+	    if (items[i].depth <= 1) {
+		write_index_entry(idx_fp, top, offset, count, size);
+		top    = &items[i];
+		offset = ftello(fp);
+		count  = 0;
+		size   = 0;
+	    } else {
+		count++;
+		size += items[i].size;
+	    }
+
+	    // evicted children are copied across without loading them
+	    if (!(items[i].flags & DIR_ITEM_EVICTED)
+		|| (e = find_evicted(items[i].ino)) == NULL
+		|| fseeko(e->fp, e->offset, SEEK_SET) != 0) {
+		continue;
+	    }
+	    for(j=0; j < e->count; j++) {
+		if (read_evicted_record(e, &items[i], &item, path, sizeof(path)) != 0) {
+		    break;
+		}
+		write_dir_item(fp, &item, path);
+		count++;
+		size += item.size;
+	    }
+	}
+    }
+    write_index_entry(idx_fp, top, offset, count, size);
+
+    pthread_mutex_unlock(&evicted_lock);
+    unlock_dir_shards(first, last);
+
+    //
+    // Now that we know how big the data file is, fill in the index
+    // header so that a mismatched pair is noticed when loading.
+    //
+    rewind(idx_fp);
+    write_index_header(idx_fp, ftello(fp));
+
+    fclose(fp);
+    fclose(idx_fp);
+
+    if (rename(tmp_name, name) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "can't rename %s to %s (%s)", tmp_name, name, strerror(errno));
+	return -1;
+    }
+    if (rename(tmp_idx_name, idx_name) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "can't rename %s to %s (%s)", tmp_idx_name, idx_name, strerror(errno));
+	unlink(idx_name);
+    }
+
+    return 0;
+}
+
+//
+// Load just the top-level directories listed in name.idx.  Their
+// subtrees are registered as evicted, pointing into name itself, and
+// get read in the first time something touches them.  Returns -1 if
+// there is no usable index, in which case nothing has been loaded.
+//
+static int
+load_dir_index(const char *name)
+{
+    FILE            *fp, *idx_fp;
+    char             buff[MAXPATHLEN+128], idx_name[MAXPATHLEN], *path;
+    int              idx_version, version, count, off, s, first, last, ret = 0;
+    long long        data_size, offset, size;
+    struct stat      st;
+    dir_item         item, *top;
+    evicted_subtree *e;
+
+    snprintf(idx_name, sizeof(idx_name), "%s.idx", name);
+    idx_fp = fopen(idx_name, "r");
+    if (idx_fp == NULL) {
+	return -1;
+    }
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+	fclose(idx_fp);
+	return -1;
+    }
+
+    if (fgets(buff, sizeof(buff), idx_fp) == NULL
+	|| sscanf(buff, "# diritems-index %d %d %lld", &idx_version, &version, &data_size) != 3
+	|| idx_version != DIR_INDEX_VERSION
+	|| fstat(fileno(fp), &st) != 0 || st.st_size != data_size) {
+	log_msg(LOG_LEVEL_WARNING, "ignoring stale index %s", idx_name);
+	fclose(idx_fp);
+	fclose(fp);
+	return -1;
+    }
+
+    lock_dir_shards(NULL, 1, &first, &last);
+    pthread_mutex_lock(&evicted_lock);
+
+    while(fgets(buff, sizeof(buff), idx_fp) != NULL) {
+	if (sscanf(buff, "%lld %d %lld %n", &offset, &count, &size, &off) != 3
+	    || (path = parse_dir_item(&buff[off], version, &item)) == NULL
+	    || (count > 0 && item.ino == 0)) {
+	    ret = -1;
+	    break;
+	}
+
+	top = add_dir_item(path_shard(path), path, item.size, item.depth, item.ino, item.mtime);
+	if (count == 0) {
+	    continue;
+	}
+
+	if (top == NULL || (e = alloc_evicted()) == NULL || (e->dirname = strdup(path)) == NULL) {
+	    ret = -1;
+	    break;
+	}
+	e->ino     = item.ino;
+	e->depth   = item.depth;
+	e->fp      = fp;
+	e->version = version;
+	e->offset  = offset;
+	e->count   = count;
+	e->size    = size;
+	num_evicted++;
+	top->flags |= DIR_ITEM_EVICTED;
+    }
+    fclose(idx_fp);
+
+    if (ret != 0) {
+	log_msg(LOG_LEVEL_ERROR, "corrupt index %s", idx_name);
+	free_all_dir_items();
+	pthread_mutex_unlock(&evicted_lock);
+	unlock_dir_shards(first, last);
+	fclose(fp);
+	return -1;
+    }
+
+    if (snapshot_fp) {
+	fclose(snapshot_fp);
+    }
+    snapshot_fp = fp;
+
+    for(s=first, count=0; s <= last; s++) {
+	cleanup_dir_items(&dir_shards[s]);
+	count += dir_shards[s].num_dir_items;
+    }
+    log_msg(LOG_LEVEL_INFO, "loaded %d top level directories from %s, %d subtrees deferred",
+	    count, idx_name, num_evicted);
+
+    pthread_mutex_unlock(&evicted_lock);
+    unlock_dir_shards(first, last);
+    return 0;
+}
+
+
+int
+load_dir_items(const char *name)
+{
+    FILE     *fp;
+    char      buff[MAXPATHLEN+64], *path;
+    int       version=1, s, first, last;
+    dir_item  item;
+
+    if (load_dir_index(name) == 0) {
+	return 0;
+    }
+
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+	log_msg(LOG_LEVEL_WARNING, "can't read %s", name);
+	return -1;
+    }
+
+    lock_dir_shards(NULL, 1, &first, &last);
+
+    // files written before the version header was introduced are version 1
+    while(fgets(buff, sizeof(buff), fp) != NULL) {
+	if (buff[0] == '#') {
+	    sscanf(buff, "# diritems %d", &version);
+	    continue;
+	}
+
+	if ((path = parse_dir_item(buff, version, &item)) == NULL) {
+	    break;
+	}
+	add_dir_item(path_shard(path), path, item.size, item.depth, item.ino, item.mtime);
+    }
+
+    // older files were sorted with plain strcmp()
+    for(s=first; s <= last; s++) {
+	cleanup_dir_items(&dir_shards[s]);
+    }
+    unlock_dir_shards(first, last);
+
+    fclose(fp);
+    return 0;
+}
+
+
+
+static int
+update_dir_item(dir_shard *shard, const char *name, off_t size, ino_t ino, time_t mtime)
+{
+    int i = find_dir_item(shard, name);
+
+    if (i < 0) {
+	return ENOENT;
+    }
+
+    shard->dir_items[i].size      = size;
+    shard->dir_items[i].last_used = time(NULL);
+    if (ino != 0) {
+	shard->dir_items[i].ino   = ino;
+	shard->dir_items[i].mtime = mtime;
+    }
+
+    return 0;
+}
+
+
+//
+// Read the children of the evicted subtree whose top directory is at
+// index idx back into its shard.  Indices are not preserved.
+//
+static int
+fault_in_subtree(dir_shard *shard, int idx)
+{
+    evicted_subtree *e;
+    dir_item         stub, item, *added;
+    char             path[MAXPATHLEN];
+    int              i, ret = 0;
+
+    pthread_mutex_lock(&evicted_lock);
+
+    shard->dir_items[idx].flags &= ~DIR_ITEM_EVICTED;
+    e = find_evicted(shard->dir_items[idx].ino);
+    if (e == NULL || fseeko(e->fp, e->offset, SEEK_SET) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "lost the evicted state for %s", shard->dir_items[idx].dirname);
+	pthread_mutex_unlock(&evicted_lock);
+	return ENOENT;
+    }
+
+    // add_dir_item() may move dir_items around, so work from a copy
+    stub = shard->dir_items[idx];
+    stub.dirname = strdup(shard->dir_items[idx].dirname);
+    for(i=0; i < e->count; i++) {
+	if (read_evicted_record(e, &stub, &item, path, sizeof(path)) != 0) {
+	    log_msg(LOG_LEVEL_ERROR, "corrupt evicted state for %s", stub.dirname);
+	    ret = EINVAL;
+	    break;
+	}
+	added = add_dir_item(shard, path, item.size, item.depth, item.ino, item.mtime);
+	if (added && e->version >= 4) {
+	    // so that polling carries on where it left off (see collect_due_dirs())
+	    added->poll_level = item.poll_level;
+	    added->last_used  = item.last_used;
+	    added->polled     = item.polled;
+	}
+    }
+    free(stub.dirname);
+    forget_evicted(stub.ino);
+
+    pthread_mutex_unlock(&evicted_lock);
+
+    cleanup_dir_items(shard);
+    return ret;
+}
+
+
+//
+// Make sure the state for path (and everything underneath it) is in
+// memory, reading back the evicted subtree containing it if need be.
+// Only top directories of subtrees are ever evicted, and they share
+// path's shard, so there is at most one to load and it's in there.
+//
+static void
+fault_in_path(dir_shard *shard, const char *path)
+{
+    int    i;
+    size_t len;
+
+    for(i=0; i < shard->num_dir_items; i++) {
+	if (shard->dir_items[i].dirname == NULL || !(shard->dir_items[i].flags & DIR_ITEM_EVICTED)) {
+	    continue;
+	}
+
+	len = strlen(shard->dir_items[i].dirname);
+	if (strncmp(path, shard->dir_items[i].dirname, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+	    __atomic_fetch_add(&state_misses, 1, __ATOMIC_RELAXED);
+	    fault_in_subtree(shard, i);
+	    return;
+	}
+    }
+
+    __atomic_fetch_add(&state_hits, 1, __ATOMIC_RELAXED);
+}
+
+
+//
+// Copy the records that are still wanted to a new eviction file and
+// switch to it.  Called with evicted_lock held.
+//
+static int
+compact_evicted(void)
+{
+    FILE    *fp;
+    char     buff[8192];
+    off_t   *offsets, left;
+    size_t   len;
+    int      i, ret = 0;
+
+    offsets = malloc((num_evicted + 1) * sizeof(off_t));
+    fp = fopen(EVICTED_ITEMS_NAME ".new", "w+");
+    if (offsets == NULL || fp == NULL) {
+	free(offsets);
+	if (fp) {
+	    fclose(fp);
+	}
+	return -1;
+    }
+
+    for(i=0; i < num_evicted && ret == 0; i++) {
+	if (evicted[i].fp != evicted_fp) {
+	    continue;
+	}
+	offsets[i] = ftello(fp);
+	if (fseeko(evicted_fp, evicted[i].offset, SEEK_SET) != 0) {
+	    ret = -1;
+	}
+	for(left=evicted[i].length; left > 0 && ret == 0; left -= len) {
+	    len = fread(buff, 1, left < (off_t)sizeof(buff) ? (size_t)left : sizeof(buff), evicted_fp);
+	    if (len == 0 || fwrite(buff, 1, len, fp) != len) {
+		ret = -1;
+	    }
+	}
+    }
+    if (ret != 0 || fflush(fp) != 0 || rename(EVICTED_ITEMS_NAME ".new", EVICTED_ITEMS_NAME) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "can't compact %s", EVICTED_ITEMS_NAME);
+	fclose(fp);
+	unlink(EVICTED_ITEMS_NAME ".new");
+	free(offsets);
+	return -1;
+    }
+
+    for(i=0; i < num_evicted; i++) {
+	if (evicted[i].fp == evicted_fp) {
+	    evicted[i].fp     = fp;
+	    evicted[i].offset = offsets[i];
+	}
+    }
+    free(offsets);
+
+    fclose(evicted_fp);
+    evicted_fp   = fp;
+    evicted_dead = 0;
+
+    return 0;
+}
+
+
+//
+// Write the children of the subtree whose top directory is at index
+// idx out to the eviction file and free them.
+//
+static int
+evict_subtree(dir_shard *shard, int idx)
+{
+    evicted_subtree *e;
+    dir_item        *items = shard->dir_items;
+    off_t            end;
+    int              i;
+
+    pthread_mutex_lock(&evicted_lock);
+
+    if (evicted_fp == NULL && (evicted_fp = fopen(EVICTED_ITEMS_NAME, "w+")) == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "can't create %s", EVICTED_ITEMS_NAME);
+	pthread_mutex_unlock(&evicted_lock);
+	return -1;
+    }
+    fseeko(evicted_fp, 0, SEEK_END);
+    end = ftello(evicted_fp);
+    if (evicted_dead > EVICTED_COMPACT_MIN && evicted_dead > end / 2 && compact_evicted() == 0) {
+	fseeko(evicted_fp, 0, SEEK_END);
+    }
+
+    if ((e = alloc_evicted()) == NULL) {
+	pthread_mutex_unlock(&evicted_lock);
+	return ENOSPC;
+    }
+
+    e->fp      = evicted_fp;
+    e->version = DIR_ITEMS_VERSION;
+    e->offset  = ftello(evicted_fp);
+    e->ino     = items[idx].ino;
+    e->depth   = items[idx].depth;
+
+    for(i=idx+1; i < shard->num_dir_items && items[i].depth > e->depth; i++) {
+	if (items[i].dirname == NULL) {
+	    continue;
+	}
+	write_dir_item(evicted_fp, &items[i], items[i].dirname);
+	e->count++;
+	e->size += items[i].size;
+    }
+    if (fflush(evicted_fp) != 0) {
+	pthread_mutex_unlock(&evicted_lock);
+	return EIO;
+    }
+    e->length = ftello(evicted_fp) - e->offset;
+
+    for(i=idx+1; i < shard->num_dir_items && items[i].depth > e->depth; i++) {
+	free(items[i].dirname);
+	items[i].dirname = NULL;
+    }
+
+    e->dirname = strdup(items[idx].dirname);
+    items[idx].flags |= DIR_ITEM_EVICTED;
+    num_evicted++;
+
+    pthread_mutex_unlock(&evicted_lock);
+
+    cleanup_dir_items(shard);
+    return 0;
+}
+
+
+void
+set_memory_budget(off_t budget, double after)
+{
+    memory_budget = budget;
+    evict_after   = after;
+}
+
+
+//
+// The memory the items in use take up.  Spare room in the shards
+// isn't counted: evicting doesn't give it back, so counting it would
+// have enforce_memory_budget() evict everything trying.
+//
+static off_t
+dir_items_memory(void)
+{
+    off_t      bytes = 0;
+    dir_shard *shard;
+    int        s, i;
+
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	shard = &dir_shards[s];
+	lock_dir_shard(shard, 0);
+
+	bytes += (off_t)shard->num_dir_items * sizeof(dir_item);
+	for(i=0; i < shard->num_dir_items; i++) {
+	    if (shard->dir_items[i].dirname) {
+		bytes += strlen(shard->dir_items[i].dirname) + 1;
+	    }
+	}
+
+	unlock_dir_shard(shard);
+    }
+
+    pthread_mutex_lock(&evicted_lock);
+    bytes += (off_t)num_evicted * sizeof(evicted_subtree);
+    pthread_mutex_unlock(&evicted_lock);
+
+    return bytes;
+}
+
+
+//
+// While we are over budget, evict the coldest top-level subtree that
+// has been idle for at least evict_after seconds.
+//
+void
+enforce_memory_budget(void)
+{
+    int        s, i, j, best;
+    time_t     now = time(NULL), newest, best_newest = 0;
+    dir_shard *shard, *best_shard;
+    dir_item  *items, *new;
+    char       best_name[MAXPATHLEN];
+
+    if (memory_budget == 0 || scan_in_progress()) {
+	return;
+    }
+
+    while (dir_items_memory() > memory_budget) {
+	best_shard = NULL;
+	for(s=0; s < NUM_DIR_SHARDS; s++) {
+	    shard = &dir_shards[s];
+	    lock_dir_shard(shard, 1);
+
+	    items = shard->dir_items;
+	    for(i=0; i < shard->num_dir_items; i++) {
+		if (items[i].dirname == NULL || items[i].depth != 1
+		    || (items[i].flags & DIR_ITEM_EVICTED)) {
+		    continue;
+		}
+
+		newest = items[i].last_used;
+		for(j=i+1; j < shard->num_dir_items && items[j].depth > 1; j++) {
+		    if (items[j].last_used > newest) {
+			newest = items[j].last_used;
+		    }
+		}
+
+		if (j == i+1 || difftime(now, newest) < evict_after) {
+		    continue;
+		}
+		if (best_shard == NULL || newest < best_newest) {
+		    best_shard  = shard;
+		    best_newest = newest;
+		    strlcpy(best_name, items[i].dirname, sizeof(best_name));
+		}
+	    }
+
+	    unlock_dir_shard(shard);
+	}
+
+	// everything left is either warm or too small to bother with
+	if (best_shard == NULL) {
+	    break;
+	}
+
+	lock_dir_shard(best_shard, 1);
+	best = find_dir_item(best_shard, best_name);
+	best = (best < 0) ? -1 : evict_subtree(best_shard, best);
+	unlock_dir_shard(best_shard);
+	if (best != 0) {
+	    break;
+	}
+    }
+
+    // give back the space we no longer need
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	shard = &dir_shards[s];
+	lock_dir_shard(shard, 1);
+	if (shard->max_dir_items > shard->num_dir_items + 2*DIR_ITEM_INCR) {
+	    new = realloc(shard->dir_items, (shard->num_dir_items + DIR_ITEM_INCR) * sizeof(dir_item));
+	    if (new) {
+		shard->dir_items = new;
+		shard->max_dir_items = shard->num_dir_items + DIR_ITEM_INCR;
+	    }
+	}
+	unlock_dir_shard(shard);
+    }
+}
+
+
+//
+// Throw away everything known about the directories underneath
+// name.  Its own item stays, depth and all, for the rescan that
+// is about to follow.
+//
+int
+remove_dir_and_children(const char *name)
+{
+    dir_shard *shard;
+    int        s, i, start, end, first, last, ret = ENOENT;
+
+    lock_dir_shards(name, 1, &first, &last);
+    fault_in_path(path_shard(name), name);
+
+    for(s=first; s <= last; s++) {
+	shard = &dir_shards[s];
+	if (subtree_range(shard, name, &start, &end) >= 0) {
+	    ret = 0;
+	    start++;
+	}
+
+	for(i=start; i < end; i++) {
+	    if (shard->dir_items[i].dirname) {
+		if (shard->dir_items[i].flags & DIR_ITEM_EVICTED) {
+		    pthread_mutex_lock(&evicted_lock);
+		    forget_evicted(shard->dir_items[i].ino);
+		    pthread_mutex_unlock(&evicted_lock);
+		}
+		free(shard->dir_items[i].dirname);
+		shard->dir_items[i].dirname = NULL;
+	    }
+
+	    shard->dir_items[i].size = 0;
+	}
+
+	cleanup_dir_items(shard);
+    }
+
+    unlock_dir_shards(first, last);
+    return ret;
+}
+
+
+//
+// Move the item at index idx and everything underneath it from
+// the shard onto the detached list.  The slots left behind have
+// their dirname set to NULL so the next cleanup_dir_items() call
+// drops them.  Returns the index of the subtree root on the
+// detached list or -1 on failure.
+//
+static int
+detach_dir_and_children(dir_shard *shard, int idx)
+{
+    int       i, start;
+    size_t    len;
+    char     *top, *dropped_top = NULL;
+    dir_item *items = shard->dir_items;
+
+    top = items[idx].dirname;
+    if (top == NULL) {
+	return -1;
+    }
+
+    pthread_mutex_lock(&detached_lock);
+
+    start = num_detached_items;
+    len   = strlen(top);
+
+    for(i=idx; i < shard->num_dir_items; i++) {
+	if (items[i].dirname == NULL) {
+	    continue;
+	}
+	if (i > idx && (strncmp(items[i].dirname, top, len) != 0
+			|| items[i].dirname[len] != '/')) {
+	    break;
+	}
+
+	if (grow_dir_items(&detached_items, num_detached_items, &max_detached_items) != 0) {
+	    // no room to keep it around: behave as if it was deleted
+	    // (but hang on to top until we're done comparing against it)
+	    if (i == idx) {
+		dropped_top = top;
+	    } else {
+		free(items[i].dirname);
+	    }
+	} else {
+	    detached_items[num_detached_items++] = items[i];
+	}
+	items[i].dirname = NULL;
+	items[i].size    = 0;
+    }
+
+    if (num_detached_items == start) {
+	start = -1;
+    }
+    pthread_mutex_unlock(&detached_lock);
+
+    if (dropped_top) {
+	free(dropped_top);
+	return -1;
+    }
+
+    return start;
+}
+
+
+//
+// Called once a batch of events has been processed: anything still
+// on the detached list was really deleted.
+//
+void
+discard_detached_dir_items(void)
+{
+    int i;
+
+    pthread_mutex_lock(&detached_lock);
+    pthread_mutex_lock(&evicted_lock);
+
+    for(i=0; i < num_detached_items; i++) {
+	if (detached_items[i].dirname) {
+	    if (detached_items[i].flags & DIR_ITEM_EVICTED) {
+		forget_evicted(detached_items[i].ino);
+	    }
+	    free(detached_items[i].dirname);
+	    detached_items[i].dirname = NULL;
+	}
+    }
+
+    num_detached_items = 0;
+
+    pthread_mutex_unlock(&evicted_lock);
+    pthread_mutex_unlock(&detached_lock);
+}
+
+
+//
+// Look for a directory we have state for with inode number ino
+// somewhere other than new_name, and move it onto the detached list
+// if it isn't there any more.  Each shard is locked on its own.
+//
+static int
+detach_moved_dir(const char *new_name, ino_t ino)
+{
+    dir_shard   *shard;
+    struct stat  st;
+    int          s, i, ret = ENOENT;
+
+    for(s=0; s < NUM_DIR_SHARDS && ret == ENOENT; s++) {
+	shard = &dir_shards[s];
+	lock_dir_shard(shard, 1);
+
+	for(i=0; i < shard->num_dir_items; i++) {
+	    if (shard->dir_items[i].dirname == NULL || shard->dir_items[i].ino != ino
+		|| strcmp(shard->dir_items[i].dirname, new_name) == 0) {
+		continue;
+	    }
+
+	    // make sure it really moved and isn't just a stale inode number
+	    if (lstat(shard->dir_items[i].dirname, &st) == 0 && st.st_ino == ino) {
+		ret = EEXIST;
+	    } else if (detach_dir_and_children(shard, i) >= 0) {
+		ret = 0;
+	    }
+	    cleanup_dir_items(shard);
+	    break;
+	}
+
+	unlock_dir_shard(shard);
+    }
+
+    return ret;
+}
+
+
+static int
+find_detached(ino_t ino)
+{
+    int i;
+
+    for(i=0; i < num_detached_items; i++) {
+	if (detached_items[i].dirname != NULL && detached_items[i].ino == ino) {
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+
+void
+set_stale_inodes(int stale)
+{
+    __atomic_store_n(&stale_inodes, stale, __ATOMIC_RELAXED);
+}
+
+
+//
+// A directory with inode number ino has just appeared at new_name.
+// If we already have state for that inode somewhere else (either
+// detached earlier in this batch, or still in the list because the
+// event for its old parent hasn't been processed yet) then it was
+// renamed: rewrite the stored paths and depths of the whole subtree
+// in place instead of re-reading it from disk.  It may well end up
+// in a different shard from the one it came from.
+//
+// Returns 0 if the subtree was re-parented, ENOENT otherwise.
+//
+static int
+reattach_renamed_dir(const char *new_name, ino_t ino, int depth)
+{
+    int         i, start, top_depth;
+    size_t      old_len, new_len;
+    const char *old_name;
+    dir_shard  *shard = path_shard(new_name);
+    dir_item   *item;
+
+    if (ino == 0 || __atomic_load_n(&stale_inodes, __ATOMIC_RELAXED)) {
+	return ENOENT;
+    }
+
+    lock_dir_shard(shard, 1);
+    pthread_mutex_lock(&detached_lock);
+    start = find_detached(ino);
+
+    if (start < 0) {
+	// only other shards get locked while looking, so let go of ours
+	pthread_mutex_unlock(&detached_lock);
+	unlock_dir_shard(shard);
+	if (detach_moved_dir(new_name, ino) != 0) {
+	    return ENOENT;
+	}
+
+	lock_dir_shard(shard, 1);
+	pthread_mutex_lock(&detached_lock);
+	start = find_detached(ino);
+	if (start < 0) {
+	    pthread_mutex_unlock(&detached_lock);
+	    unlock_dir_shard(shard);
+	    return ENOENT;
+	}
+    }
+
+    old_name  = detached_items[start].dirname;
+    old_len   = strlen(old_name);
+    new_len   = strlen(new_name);
+    top_depth = detached_items[start].depth;
+
+    for(i=start; i < num_detached_items; i++) {
+	char *name = detached_items[i].dirname;
+	char *renamed;
+
+	if (name == NULL) {
+	    continue;
+	}
+	if (i > start && (strncmp(name, old_name, old_len) != 0 || name[old_len] != '/')) {
+	    break;
+	}
+	if (grow_dir_items(&shard->dir_items, shard->num_dir_items, &shard->max_dir_items) != 0) {
+	    break;
+	}
+
+	renamed = malloc(new_len + strlen(name) - old_len + 1);
+	if (renamed == NULL) {
+	    break;
+	}
+	memcpy(renamed, new_name, new_len);
+	strcpy(&renamed[new_len], &name[old_len]);
+
+	item = &shard->dir_items[shard->num_dir_items++];
+	*item         = detached_items[i];
+	item->dirname = renamed;
+	item->depth   = depth + (detached_items[i].depth - top_depth);
+	item->state   = 0;
+
+	// old_name points into the subtree root, so free that one last
+	if (i > start) {
+	    free(name);
+	    detached_items[i].dirname = NULL;
+	}
+    }
+
+    free(detached_items[start].dirname);
+    detached_items[start].dirname = NULL;
+
+    shard->unsorted = 1;
+    pthread_mutex_unlock(&detached_lock);
+    unlock_dir_shard(shard);
+
+    return 0;
+}
+
+
+// note: this returns zero if the directory exists
+//       otherwise it returns one (i.e. true).
+static int
+dir_does_not_exist(const char *name)
+{
+    dir_shard *shard = path_shard(name);
+    int        i, ret = 1;
+
+    lock_dir_shard(shard, 0);
+    i = find_dir_item(shard, name);
+    if (i >= 0 && shard->dir_items[i].size != 0) {
+	ret = 0;
+    }
+    unlock_dir_shard(shard);
+
+    return ret;
+}
+
+
+//
+// Number of directories and total size of everything at or under
+// path, counting evicted subtrees without loading them.
+//
+void
+get_subtree_totals(const char *path, int *num_dirs, off_t *size)
+{
+    int              s, i, first, last;
+    size_t           len = strlen(path);
+    dir_item        *items;
+    evicted_subtree *e;
+
+    lock_dir_shards(path, 1, &first, &last);
+    fault_in_path(path_shard(path), path);
+
+    *num_dirs = 0;
+    *size     = 0;
+    pthread_mutex_lock(&evicted_lock);
+    for(s=first; s <= last; s++) {
+	items = dir_shards[s].dir_items;
+	for(i=0; i < dir_shards[s].num_dir_items; i++) {
+	    if (items[i].dirname == NULL || strncmp(items[i].dirname, path, len) != 0
+		|| (items[i].dirname[len] != '\0' && items[i].dirname[len] != '/')) {
+		continue;
+	    }
+
+	    (*num_dirs)++;
+	    *size += items[i].size;
+	    if ((items[i].flags & DIR_ITEM_EVICTED) && (e = find_evicted(items[i].ino))) {
+		*num_dirs += e->count;
+		*size     += e->size;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&evicted_lock);
+
+    unlock_dir_shards(first, last);
+}
+
+
+off_t
+get_total_size(void)
+{
+    int   s, i, first, last;
+    off_t size=0;
+
+    lock_dir_shards(NULL, 0, &first, &last);
+    for(s=first; s <= last; s++) {
+	for(i=0; i < dir_shards[s].num_dir_items; i++) {
+	    if (dir_shards[s].dir_items[i].dirname) {
+		size += dir_shards[s].dir_items[i].size;
+	    }
+	}
+    }
+    unlock_dir_shards(first, last);
+
+    pthread_mutex_lock(&evicted_lock);
+    for(i=0; i < num_evicted; i++) {
+	size += evicted[i].size;
+    }
+    pthread_mutex_unlock(&evicted_lock);
+
+    return size;
+}
+
+
+int
+get_num_dir_items(void)
+{
+    int s, first, last, count = 0;
+
+    lock_dir_shards(NULL, 0, &first, &last);
+    for(s=first; s <= last; s++) {
+	count += dir_shards[s].num_dir_items;
+    }
+    unlock_dir_shards(first, last);
+
+    return count;
+}
+
+
+//
+//--------------------------------------------------------------------------------
+// Bulk scan scheduling.
+//
+// Full scans (the initial one and the rescans forced by dropped
+// events) are broken up one directory at a time and paced by a token
+// bucket so that they don't saturate the disk or a network mount.
+// They run on a scanner thread of their own, whose disk I/O is marked
+// as throttled, so live events -- which never touch the bucket --
+// are handled on the run loop at the same time.  The two only meet
+// in the state shards, and only when they are in the same part of
+// the tree.  When the queue runs dry the run loop is told, so that
+// the follow-up work (imports, eviction) happens there.
+//
+
+typedef struct scan_budget {
+    double          ops_per_sec;       // 0 means unlimited
+    double          bytes_per_sec;     // 0 means unlimited
+    double          ops;               // tokens currently available
+    double          bytes;
+    CFAbsoluteTime  last_refill;
+    uint64_t        total_ops;
+    uint64_t        total_bytes;
+    uint64_t        num_waits;
+    double          wait_time;
+} scan_budget_t;
+
+// don't let a single huge directory run up more than this much debt
+#define SCAN_MAX_DEBT  1.0      // seconds
+
+scan_budget_t       scan_budget;
+__thread int        in_bulk_scan=0;    // set on the scanner thread
+
+// see reconcile_dir_items()
+__thread time_t     probe_since=0;
+__thread int        num_reconciled=0;
+__thread int        num_reconcile_changed=0;
+
+// see "importing .skim files" at the end
+int                 import_skim=0;
+uint64_t            num_skim_imports=0;
+uint64_t            num_skim_import_failures=0;
+uint64_t            num_skim_conflicts=0;
+uint64_t            num_skim_loops=0;
+pthread_mutex_t     skim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// see "notes index" at the end
+int                 index_notes=0;
+
+// see "directory reading" below
+int                 use_bulk_attrs=1;
+uint64_t            num_bulk_calls=0;
+uint64_t            num_bulk_entries=0;
+uint64_t            num_lstats=0;
+
+//
+// scan_lock covers the queue, the budget and the scanner's state.
+//
+dir_item           *scan_queue=NULL;     // uses state to hold the "add" flag, SCAN_SNAPSHOT or SCAN_RECONCILE
+int                 num_scan_queue=0;
+int                 max_scan_queue=0;
+pthread_mutex_t     scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      scan_cond = PTHREAD_COND_INITIALIZER;
+pthread_t           scan_thread;
+int                 scan_thread_running=0;
+int                 scan_busy=0;         // in the middle of a directory
+int                 scan_waiting=0;      // for the budget
+int                 scan_quit=0;
+int                 scan_cancelling=0;   // see scan_cancelled()
+CFRunLoopSourceRef  scan_done_source=NULL;
+CFRunLoopRef        scan_done_loop=NULL;
+
+// a queued "directory" that is really a snapshot to start from
+#define SCAN_SNAPSHOT  2
+// one to reconcile (see reconcile_dir_items()), with the time in mtime
+#define SCAN_RECONCILE 3
+
+static off_t iterate_subdirs(const char *dirname, int add, int recursive, int depth);
+static int   load_snapshot(const char *name);
+static int   scan_cancelled(void);
+
+void
+set_scan_budget(double ops_per_sec, double bytes_per_sec)
+{
+    pthread_mutex_lock(&scan_lock);
+    scan_budget.ops_per_sec   = ops_per_sec;
+    scan_budget.bytes_per_sec = bytes_per_sec;
+    scan_budget.ops           = ops_per_sec;
+    scan_budget.bytes         = bytes_per_sec;
+    scan_budget.last_refill   = CFAbsoluteTimeGetCurrent();
+    pthread_cond_signal(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+
+//
+// Top the bucket up for the time that has passed and return how
+// long we have to wait until it is out of debt.  The bucket holds
+// at most one second's worth of tokens.  Called with scan_lock held.
+//
+static double
+scan_budget_wait_time(void)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    double         elapsed = now - scan_budget.last_refill, wait = 0;
+
+    if (elapsed < 0) {
+	elapsed = 0;
+    }
+    scan_budget.last_refill = now;
+
+    if (scan_budget.ops_per_sec > 0) {
+	scan_budget.ops += elapsed * scan_budget.ops_per_sec;
+	if (scan_budget.ops > scan_budget.ops_per_sec) {
+	    scan_budget.ops = scan_budget.ops_per_sec;
+	}
+	if (scan_budget.ops < 0) {
+	    wait = -scan_budget.ops / scan_budget.ops_per_sec;
+	}
+    }
+
+    if (scan_budget.bytes_per_sec > 0) {
+	scan_budget.bytes += elapsed * scan_budget.bytes_per_sec;
+	if (scan_budget.bytes > scan_budget.bytes_per_sec) {
+	    scan_budget.bytes = scan_budget.bytes_per_sec;
+	}
+	if (scan_budget.bytes < 0 && -scan_budget.bytes / scan_budget.bytes_per_sec > wait) {
+	    wait = -scan_budget.bytes / scan_budget.bytes_per_sec;
+	}
+    }
+
+    return wait;
+}
+
+
+//
+// Account for file system work.  Only bulk scans pay; anything done
+// on behalf of a live event is free.
+//
+// The scanner reads directories with their shards locked (all of them
+// for the top level), and sleeping there would hold up every event
+// and conversion lookup behind the throttle.  So with a shard held
+// the work is only counted, and the wait happens in pay_scan_debt()
+// once the last shard is let go.
+//
+void
+charge_scan_budget(int ops, off_t bytes)
+{
+    if (!in_bulk_scan) {
+	return;
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    if (scan_budget.ops_per_sec > 0) {
+	scan_budget.ops -= ops;
+    }
+    if (scan_budget.bytes_per_sec > 0) {
+	scan_budget.bytes -= bytes;
+    }
+    scan_budget.total_ops   += ops;
+    scan_budget.total_bytes += bytes;
+
+    pthread_mutex_unlock(&scan_lock);
+
+    if (shards_held > 0) {
+	scan_debt_deferred = 1;
+    } else {
+	pay_scan_debt();
+    }
+}
+
+
+void
+pay_scan_debt(void)
+{
+    double wait;
+
+    scan_debt_deferred = 0;
+
+    pthread_mutex_lock(&scan_lock);
+    wait = scan_budget_wait_time();
+    if (wait > SCAN_MAX_DEBT) {
+	scan_budget.num_waits++;
+	scan_budget.wait_time += wait;
+    }
+    pthread_mutex_unlock(&scan_lock);
+
+    if (wait > SCAN_MAX_DEBT) {
+	usleep((useconds_t)(wait * 1000000));
+    }
+}
+
+
+// called with scan_lock held
+static dir_item *
+push_scan_queue(const char *dirname, int add, int depth)
+{
+    if (grow_dir_items(&scan_queue, num_scan_queue, &max_scan_queue) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "no memory to queue %s for scanning", dirname);
+	return NULL;
+    }
+
+    scan_queue[num_scan_queue].dirname = strdup(dirname);
+    scan_queue[num_scan_queue].depth   = depth;
+    scan_queue[num_scan_queue].state   = add;
+    scan_queue[num_scan_queue].mtime   = 0;
+    return &scan_queue[num_scan_queue++];
+}
+
+
+//
+// Runs on the run loop once the scanner has emptied its queue.
+//
+static void
+scan_done_callback(void *info)
+{
+    int throttled;
+
+    if (scan_in_progress()) {
+	// more turned up in the meantime
+	return;
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    throttled = (scan_budget.ops_per_sec > 0 || scan_budget.bytes_per_sec > 0);
+    pthread_mutex_unlock(&scan_lock);
+
+    log_msg(LOG_LEVEL_INFO, "%s finished.  Total size is: %lld", throttled ? "Throttled scan" : "Scan",
+	    get_total_size());
+    if (throttled) {
+	dump_stats(stdout);
+    }
+
+    run_skim_imports();
+    enforce_memory_budget();
+}
+
+
+//
+// Scan queued directories as the budget allows, one at a time, until
+// told to quit.
+//
+static void *
+scanner(void *arg)
+{
+    dir_item        item;
+    double          wait;
+    struct timeval  now;
+    struct timespec wakeup;
+
+    setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+    in_bulk_scan = 1;
+
+    pthread_mutex_lock(&scan_lock);
+    while (!scan_quit) {
+	if (num_scan_queue == 0) {
+	    pthread_cond_wait(&scan_cond, &scan_lock);
+	    continue;
+	}
+
+	if ((wait = scan_budget_wait_time()) > 0) {
+	    scan_budget.num_waits++;
+	    scan_budget.wait_time += wait;
+
+	    gettimeofday(&now, NULL);
+	    wakeup.tv_sec  = now.tv_sec + (time_t)wait;
+	    wakeup.tv_nsec = now.tv_usec * 1000 + (long)((wait - (time_t)wait) * 1000000000);
+	    if (wakeup.tv_nsec >= 1000000000) {
+		wakeup.tv_sec  += 1;
+		wakeup.tv_nsec -= 1000000000;
+	    }
+
+	    scan_waiting = 1;
+	    pthread_cond_timedwait(&scan_cond, &scan_lock, &wakeup);
+	    scan_waiting = 0;
+	    continue;
+	}
+
+	item = scan_queue[--num_scan_queue];
+	scan_busy = 1;
+	pthread_mutex_unlock(&scan_lock);
+
+	if (item.state == SCAN_SNAPSHOT) {
+	    if (load_snapshot(item.dirname) != 0 && !scan_cancelled()) {
+		// no good, so scan as usual
+		pthread_mutex_lock(&scan_lock);
+		push_scan_queue(state_root, 1, 0);
+		pthread_mutex_unlock(&scan_lock);
+	    }
+	} else if (item.state == SCAN_RECONCILE) {
+	    if (reconcile_dir_items(item.dirname, item.mtime) != 0) {
+		// we know nothing about it, so scan it from scratch
+		remove_dir_and_children(item.dirname);
+		pthread_mutex_lock(&scan_lock);
+		push_scan_queue(item.dirname, 1, 0);
+		pthread_mutex_unlock(&scan_lock);
+	    }
+	} else {
+	    iterate_subdirs(item.dirname, item.state, 1, item.depth);
+	}
+	free(item.dirname);
+
+	pthread_mutex_lock(&scan_lock);
+	scan_busy = 0;
+	if (num_scan_queue == 0) {
+	    // for cancel_pending_scans()
+	    pthread_cond_broadcast(&scan_cond);
+
+	    if (scan_done_source) {
+		CFRunLoopSourceSignal(scan_done_source);
+		CFRunLoopWakeUp(scan_done_loop);
+	    }
+	}
+    }
+    pthread_mutex_unlock(&scan_lock);
+
+    return NULL;
+}
+
+
+//
+// Called with scan_lock held.  The first time round this also hooks
+// scan_done_callback() up to the current run loop.
+//
+static int
+start_scanner(void)
+{
+    CFRunLoopSourceContext context = { 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, scan_done_callback };
+
+    if (scan_thread_running) {
+	return 0;
+    }
+
+    scan_quit = 0;
+    if (pthread_create(&scan_thread, NULL, scanner, NULL) != 0) {
+	return -1;
+    }
+    scan_thread_running = 1;
+
+    if (scan_done_source == NULL) {
+	scan_done_loop   = CFRunLoopGetCurrent();
+	scan_done_source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+	if (scan_done_source) {
+	    CFRunLoopAddSource(scan_done_loop, scan_done_source, kCFRunLoopDefaultMode);
+	}
+    }
+
+    return 0;
+}
+
+
+void
+stop_scanner(void)
+{
+    pthread_mutex_lock(&scan_lock);
+    if (!scan_thread_running) {
+	pthread_mutex_unlock(&scan_lock);
+	return;
+    }
+    scan_quit = 1;
+    pthread_cond_broadcast(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+
+    pthread_join(scan_thread, NULL);
+    scan_thread_running = 0;
+
+    cancel_pending_scans();
+
+    if (scan_done_source) {
+	CFRunLoopRemoveSource(scan_done_loop, scan_done_source, kCFRunLoopDefaultMode);
+	CFRelease(scan_done_source);
+	scan_done_source = NULL;
+    }
+}
+
+
+int
+scan_in_progress(void)
+{
+    int busy;
+
+    pthread_mutex_lock(&scan_lock);
+    busy = (num_scan_queue > 0 || scan_busy);
+    pthread_mutex_unlock(&scan_lock);
+
+    return busy;
+}
+
+
+//
+// Empty the queue and wait for the scanner to finish the directory
+// it is on (if any), so the state can be thrown away or saved.
+//
+void
+cancel_pending_scans(void)
+{
+    pthread_mutex_lock(&scan_lock);
+    while (num_scan_queue > 0) {
+	free(scan_queue[--num_scan_queue].dirname);
+    }
+    scan_cancelling = 1;
+    while (scan_busy) {
+	pthread_cond_wait(&scan_cond, &scan_lock);
+    }
+    scan_cancelling = 0;
+    pthread_mutex_unlock(&scan_lock);
+}
+
+
+//
+// A directory doesn't take long, but a snapshot is a whole tree, so
+// load_snapshot() checks this as it goes and gives up early.
+//
+static int
+scan_cancelled(void)
+{
+    int cancelled;
+
+    pthread_mutex_lock(&scan_lock);
+    cancelled = (scan_quit || scan_cancelling);
+    pthread_mutex_unlock(&scan_lock);
+
+    return cancelled;
+}
+
+
+void
+dump_stats(FILE *fp)
+{
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t      info_count;
+    scan_budget_t               budget;
+    int                         queued, waiting;
+
+    pthread_mutex_lock(&scan_lock);
+    budget  = scan_budget;
+    queued  = num_scan_queue;
+    waiting = scan_waiting;
+    pthread_mutex_unlock(&scan_lock);
+
+    fprintf(fp, "total size: %lld\n", get_total_size());
+    fprintf(fp, "directories: %d (in %d shards)\n", get_num_dir_items(), NUM_DIR_SHARDS);
+    fprintf(fp, "scan queue: %d directories%s\n", queued,
+	    waiting ? " (waiting for budget)" : "");
+    fprintf(fp, "scan budget: %.0f ops/sec, %.0f bytes/sec (0 = unlimited)\n",
+	    budget.ops_per_sec, budget.bytes_per_sec);
+    fprintf(fp, "scan tokens: %.0f ops, %.0f bytes\n", budget.ops, budget.bytes);
+    fprintf(fp, "scan totals: %llu ops, %llu bytes, %llu waits, %.3f sec throttled\n",
+	    (unsigned long long)budget.total_ops, (unsigned long long)budget.total_bytes,
+	    (unsigned long long)budget.num_waits, budget.wait_time);
+    fprintf(fp, "state memory: %lld bytes (budget %lld, 0 = unlimited)\n",
+	    (long long)dir_items_memory(), (long long)memory_budget);
+    pthread_mutex_lock(&evicted_lock);
+    fprintf(fp, "evicted or unloaded subtrees: %d, lookups: %llu hits, %llu misses\n", num_evicted,
+	    (unsigned long long)__atomic_load_n(&state_hits, __ATOMIC_RELAXED),
+	    (unsigned long long)__atomic_load_n(&state_misses, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&evicted_lock);
+
+    fprintf(fp, "directory reads: %llu bulk calls returning %llu entries, %llu lstats%s\n",
+	    (unsigned long long)__atomic_load_n(&num_bulk_calls, __ATOMIC_RELAXED),
+	    (unsigned long long)__atomic_load_n(&num_bulk_entries, __ATOMIC_RELAXED),
+	    (unsigned long long)__atomic_load_n(&num_lstats, __ATOMIC_RELAXED),
+	    __atomic_load_n(&use_bulk_attrs, __ATOMIC_RELAXED) ? "" : " (bulk reads off)");
+
+    dump_poll_stats(fp);
+    dump_idle_stats(fp);
+    dump_snapshot_stats(fp);
+    dump_conversion_stats(fp);
+    if (__atomic_load_n(&index_notes, __ATOMIC_RELAXED)) {
+	dump_index_stats(fp);
+    }
+    dump_log_stats(fp);
+    if (import_skim) {
+	pthread_mutex_lock(&skim_lock);
+	fprintf(fp, "skim imports: %llu done, %llu failed, %llu conflicts, %llu skipped as our own\n",
+		(unsigned long long)num_skim_imports, (unsigned long long)num_skim_import_failures,
+		(unsigned long long)num_skim_conflicts, (unsigned long long)num_skim_loops);
+	pthread_mutex_unlock(&skim_lock);
+    }
+
+    info_count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &info_count) == KERN_SUCCESS) {
+	fprintf(fp, "resident size: %llu bytes\n", (unsigned long long)info.resident_size);
+    }
+}
+
+
+//
+// ----------------- directory reading ---------------------
+//
+// Reading a directory with readdir() and then lstat()ing every entry
+// costs a system call, and on network file systems a round trip, per
+// file.  getattrlistbulk(2) hands back the name, type, inode and size
+// of as many entries as fit in the buffer in one call, so where it is
+// available that's what we use.  If it isn't (older systems, or a file
+// system that refuses it) we quietly fall back to readdir()/lstat().
+//
+// Directory sizes aren't part of what getattrlistbulk() returns, so
+// subdirectories still get an lstat() of their own; they are a small
+// fraction of the entries in any real tree.  Each PDF still gets a
+// getxattr() for its notes either way, so with a slow round trip this
+// halves the calls a scan makes rather than doing away with them
+// ("WatcherBench scan" measures it).
+//
+#define DIR_READ_BUF_SIZE  (64*1024)
+
+typedef struct dir_reader {
+    DIR         *dir;
+    const char  *dirname;
+    int          bulk;           // using getattrlistbulk()
+    char        *buf;
+    char        *next;           // next entry in buf
+    int          count;          // entries left in buf
+    char         path[PATH_MAX];
+} dir_reader;
+
+typedef struct dir_entry {
+    const char  *name;
+    const char  *path;           // dirname/name
+    int          is_dir;
+    off_t        size;
+    ino_t        ino;
+    time_t       ctime;
+} dir_entry;
+
+#ifdef ATTR_CMN_ERROR
+typedef struct bulk_entry_header {
+    uint32_t        length;
+    attribute_set_t returned;
+} __attribute__((packed)) bulk_entry_header;
+#endif
+
+
+void
+set_bulk_attrs(int enabled)
+{
+    __atomic_store_n(&use_bulk_attrs, enabled, __ATOMIC_RELAXED);
+}
+
+
+static int
+open_dir_reader(dir_reader *reader, const char *dirname)
+{
+    memset(reader, 0, sizeof(dir_reader));
+    reader->dirname = dirname;
+
+    reader->dir = opendir(dirname);
+    if (reader->dir == NULL) {
+	return -1;
+    }
+
+#ifdef ATTR_CMN_ERROR
+    if (__atomic_load_n(&use_bulk_attrs, __ATOMIC_RELAXED)) {
+	reader->buf = malloc(DIR_READ_BUF_SIZE);
+	reader->bulk = (reader->buf != NULL);
+    }
+#endif
+
+    return 0;
+}
+
+
+static void
+close_dir_reader(dir_reader *reader)
+{
+    closedir(reader->dir);
+    free(reader->buf);
+    reader->dir = NULL;
+    reader->buf = NULL;
+}
+
+
+static int
+stat_dir_entry(dir_reader *reader, dir_entry *entry)
+{
+    struct stat st;
+
+    __atomic_fetch_add(&num_lstats, 1, __ATOMIC_RELAXED);
+    charge_scan_budget(1, 0);
+    if (lstat(entry->path, &st) != 0) {
+	log_msg(LOG_LEVEL_WARNING, "Error stating %s : %s", entry->path, strerror(errno));
+	return -1;
+    }
+
+    entry->is_dir = S_ISDIR(st.st_mode);
+    entry->size   = st.st_size;
+    entry->ino    = st.st_ino;
+    entry->ctime  = st.st_ctime;
+
+    return 0;
+}
+
+
+#ifdef ATTR_CMN_ERROR
+//
+// Unpack the next entry from the getattrlistbulk() buffer.  The
+// attributes come in the order of their bits, except that the error
+// (if any) always comes straight after the returned attribute set.
+//
+static int
+unpack_bulk_entry(dir_reader *reader, dir_entry *entry)
+{
+    bulk_entry_header  header;
+    attrreference_t    name_ref;
+    fsobj_type_t       obj_type = VNON;
+    struct timespec    change_time = { 0, 0 };
+    uint32_t           error = 0;
+    uint64_t           file_id = 0;
+    off_t              size = 0;
+    char              *entry_start = reader->next, *ptr;
+
+    memcpy(&header, entry_start, sizeof(header));
+    reader->next += header.length;
+    reader->count--;
+
+    charge_scan_budget(0, header.length);
+
+    ptr = entry_start + sizeof(header);
+    if (header.returned.commonattr & ATTR_CMN_ERROR) {
+	memcpy(&error, ptr, sizeof(error));
+	ptr += sizeof(error);
+    }
+    if (header.returned.commonattr & ATTR_CMN_NAME) {
+	memcpy(&name_ref, ptr, sizeof(name_ref));
+	entry->name = ptr + name_ref.attr_dataoffset;
+	ptr += sizeof(name_ref);
+    } else {
+	return -1;
+    }
+    if (header.returned.commonattr & ATTR_CMN_OBJTYPE) {
+	memcpy(&obj_type, ptr, sizeof(obj_type));
+	ptr += sizeof(obj_type);
+    }
+    if (header.returned.commonattr & ATTR_CMN_CHGTIME) {
+	memcpy(&change_time, ptr, sizeof(change_time));
+	ptr += sizeof(change_time);
+    }
+    if (header.returned.commonattr & ATTR_CMN_FILEID) {
+	memcpy(&file_id, ptr, sizeof(file_id));
+	ptr += sizeof(file_id);
+    }
+    if (header.returned.fileattr & ATTR_FILE_DATALENGTH) {
+	memcpy(&size, ptr, sizeof(size));
+	ptr += sizeof(size);
+    }
+
+    snprintf(reader->path, sizeof(reader->path), "%s/%s", reader->dirname, entry->name);
+    entry->path = reader->path;
+
+    if (error != 0 || obj_type == VDIR) {
+	// let lstat() sort it out (and report any error)
+	return stat_dir_entry(reader, entry);
+    }
+
+    entry->is_dir = 0;
+    entry->size   = size;
+    entry->ino    = (ino_t)file_id;
+    entry->ctime  = change_time.tv_sec;
+
+    return 0;
+}
+
+
+static int
+fill_bulk_buffer(dir_reader *reader)
+{
+    struct attrlist attrs;
+    int             count;
+
+    memset(&attrs, 0, sizeof(attrs));
+    attrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attrs.commonattr  = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | ATTR_CMN_ERROR
+			| ATTR_CMN_OBJTYPE | ATTR_CMN_CHGTIME | ATTR_CMN_FILEID;
+    attrs.fileattr    = ATTR_FILE_DATALENGTH;
+
+    charge_scan_budget(1, 0);
+    count = getattrlistbulk(dirfd(reader->dir), &attrs, reader->buf, DIR_READ_BUF_SIZE, 0);
+    if (count < 0) {
+	return -1;
+    }
+
+    __atomic_fetch_add(&num_bulk_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&num_bulk_entries, count, __ATOMIC_RELAXED);
+    reader->next  = reader->buf;
+    reader->count = count;
+
+    return count;
+}
+#endif
+
+
+//
+// Returns 1 and fills in entry for the next thing in the directory,
+// 0 at the end, or -1 (with errno set) if the directory can't be read
+// any further, in which case what has been read so far is not the
+// whole of it.  Entries that can't be stat'ed are skipped.
+// entry->name and entry->path are only good until the next call.
+//
+static int
+read_dir_entry(dir_reader *reader, dir_entry *entry)
+{
+    struct dirent *dirent;
+
+#ifdef ATTR_CMN_ERROR
+    while (reader->bulk) {
+	if (reader->count == 0) {
+	    int count = fill_bulk_buffer(reader);
+
+	    if (count == 0) {
+		return 0;
+	    } else if (count < 0) {
+		if (errno != ENOTSUP && errno != ENOSYS) {
+		    log_msg(LOG_LEVEL_WARNING, "getattrlistbulk(%s) failed (%s)", reader->dirname, strerror(errno));
+		    return -1;
+		}
+		if (__atomic_load_n(&num_bulk_calls, __ATOMIC_RELAXED) == 0) {
+		    // nothing has worked yet, so don't bother trying again
+		    __atomic_store_n(&use_bulk_attrs, 0, __ATOMIC_RELAXED);
+		}
+		// nothing has been read, so readdir() starts from the top
+		reader->bulk = 0;
+		break;
+	    }
+	}
+
+	if (unpack_bulk_entry(reader, entry) == 0) {
+	    return 1;
+	}
+    }
+#endif
+
+    for(;;) {
+	errno = 0;
+	if ((dirent = readdir(reader->dir)) == NULL) {
+	    break;
+	}
+	if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+	    continue;
+
+	snprintf(reader->path, sizeof(reader->path), "%s/%s", reader->dirname, dirent->d_name);
+	entry->name = dirent->d_name;
+	entry->path = reader->path;
+
+	charge_scan_budget(0, dirent->d_reclen);
+	if (stat_dir_entry(reader, entry) == 0) {
+	    return 1;
+	}
+    }
+    if (errno != 0) {
+	log_msg(LOG_LEVEL_WARNING, "readdir(%s) failed (%s)", reader->dirname, strerror(errno));
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static off_t
+iterate_subdirs(const char *dirname, int add, int recursive, int depth)
+{
+    dir_reader    *reader;
+    dir_entry      entry;
+    struct stat    st;
+    off_t          size=0, result=0;
+    ino_t          dir_ino=0;
+    time_t         dir_mtime=0;
+    dir_shard     *shard = path_shard(dirname);
+    int            i, ret;
+    double         trace_start = tracing(SCAN_DONE) ? time_now() : 0;
+
+    trace(SCAN_START, (char *)dirname, log_event_id);
+
+    reader = malloc(sizeof(dir_reader));
+    if (reader == NULL) {
+	return -1;
+    }
+
+    //
+    // The scanner and a live event can both come across a new
+    // directory, so only add it if nobody else has yet.
+    //
+    lock_dir_shard(shard, 1);
+    i = find_dir_item(shard, dirname);
+    if (i >= 0) {
+	if (depth == 0) {
+	    depth = shard->dir_items[i].depth;
+	}
+    } else if (add) {
+	add_dir_item(shard, dirname, 0, depth, 0, 0);
+    }
+    unlock_dir_shard(shard);
+
+    charge_scan_budget(1, 0);
+    if (open_dir_reader(reader, dirname) != 0) {
+	free(reader);
+	if (errno == ENOENT) {             // it may have been deleted.
+	    lock_dir_shard(shard, 1);
+	    update_dir_item(shard, dirname, 0, 0, 0);
+	    unlock_dir_shard(shard);
+	    return 0;
+	}
+
+	log_msg(LOG_LEVEL_WARNING, "failed to opendir(%s) (%s)", dirname, strerror(errno));
+	return -1;
+    }
+
+    // remember the inode so a later rename can be recognised
+    if (fstat(dirfd(reader->dir), &st) == 0) {
+	dir_ino   = st.st_ino;
+	dir_mtime = st.st_mtime;
+    }
+
+    while ((ret = read_dir_entry(reader, &entry)) > 0) {
+	execute_for_path(entry.path);
+
+	size += entry.size;
+
+	if (entry.is_dir && (recursive || dir_does_not_exist(entry.path))) {
+	    if (in_bulk_scan) {
+		// the scan queue will get to it in its own time
+		pthread_mutex_lock(&scan_lock);
+		push_scan_queue(entry.path, add, depth+1);
+		pthread_mutex_unlock(&scan_lock);
+		continue;
+	    }
+	    result = iterate_subdirs(entry.path, add, 1, depth+1);
+	    if (result < 0) {
+		log_msg(LOG_LEVEL_WARNING, "error getting size for %s", entry.path);
+	    }
+	}
+    }
+
+    close_dir_reader(reader);
+    free(reader);
+
+    // only part of it was read, so the size we have is better than this one
+    if (ret < 0) {
+	return -1;
+    }
+
+    lock_dir_shard(shard, 1);
+    if (update_dir_item(shard, dirname, size, dir_ino, dir_mtime) == ENOENT) {
+	add_dir_item(shard, dirname, size, depth, dir_ino, dir_mtime);
+    }
+    unlock_dir_shard(shard);
+
+    trace(SCAN_DONE, (char *)dirname, log_event_id, size, trace_usecs_since(trace_start));
+
+    return size;
+}
+
+
+//
+// Bring what we know about dirname's immediate children in line with
+// the disk.  The shards involved (all of them, for the root) stay
+// locked while the directory is read and compared, but are let go
+// before new subdirectories are re-parented or scanned, since those
+// can live in other shards, and before the entries are probed, since
+// that can import notes or tell a client.
+//
+int
+check_children_of_dir(const char *dirname)
+{
+    int            i, s, idx, first, last, current_depth, ret;
+    int            start_idx[NUM_DIR_SHARDS], end_idx[NUM_DIR_SHARDS];
+    struct stat    st;
+    off_t          dir_size;
+    time_t         dir_mtime;
+    dir_reader    *reader;
+    dir_entry      entry;
+    dir_shard     *home = path_shard(dirname), *shard;
+    dir_item      *items, *new_dirs = NULL, *probes = NULL;
+    int            num_new_dirs = 0, max_new_dirs = 0, num_probes = 0, max_probes = 0;
+    double         trace_start = tracing(CHECK_DONE) ? time_now() : 0;
+
+    trace(CHECK_START, (char *)dirname, log_event_id);
+
+    reader = malloc(sizeof(dir_reader));
+    if (reader == NULL) {
+	return -1;
+    }
+
+    lock_dir_shards(dirname, 1, &first, &last);
+    fault_in_path(home, dirname);
+
+    idx = find_dir_item(home, dirname);
+    if (idx < 0) {
+	unlock_dir_shards(first, last);
+	free(reader);
+	return -1;
+    }
+    current_depth = home->dir_items[idx].depth;
+
+    for(s=first; s <= last; s++) {
+	subtree_range(&dir_shards[s], dirname, &start_idx[s], &end_idx[s]);
+    }
+
+    if (open_dir_reader(reader, dirname) != 0) {
+	free(reader);
+	if (errno == ENOENT) {
+	    for(s=first; s <= last; s++) {
+		for(i=start_idx[s]; i < end_idx[s]; i++) {
+		    dir_shards[s].dir_items[i].size = 0;
+		}
+	    }
+
+	    unlock_dir_shards(first, last);
+	    return 0;
+	}
+
+	unlock_dir_shards(first, last);
+	log_msg(LOG_LEVEL_WARNING, "failed to opendir(%s) (%s)", dirname, strerror(errno));
+	return -1;
+    }
+
+    dir_mtime = home->dir_items[idx].mtime;
+    if (fstat(dirfd(reader->dir), &st) == 0) {
+	dir_mtime = st.st_mtime;
+    }
+    home->dir_items[idx].last_used = time(NULL);
+
+    dir_size = 0;
+    while ((ret = read_dir_entry(reader, &entry)) > 0) {
+	// a child is in the same shard as its parent, except below the root
+	s     = path_shard(entry.path) - dir_shards;
+	items = dir_shards[s].dir_items;
+	for(i=start_idx[s]; i < end_idx[s]; i++) {
+	    if (items[i].dirname == NULL) {
+		continue;
+	    }
+
+	    if (items[i].depth == current_depth+1 && strcmp(items[i].dirname, entry.path) == 0) {
+		// flag that it exists
+		items[i].state = 1;
+		break;
+	    }
+	}
+
+	if (entry.is_dir) {
+	    if (i >= end_idx[s]
+		&& grow_dir_items(&new_dirs, num_new_dirs, &max_new_dirs) == 0) {
+		// printf("NEW item: %s\n", entry.path);
+		// handled below, once we know what disappeared
+		new_dirs[num_new_dirs].dirname = strdup(entry.path);
+		new_dirs[num_new_dirs].ino     = entry.ino;
+		num_new_dirs++;
+	    }
+	}
+	dir_size += entry.size;
+	if ((entry.is_dir || entry.ctime >= probe_since)
+	    && grow_dir_items(&probes, num_probes, &max_probes) == 0) {
+	    probes[num_probes++].dirname = strdup(entry.path);
+	}
+    }
+    close_dir_reader(reader);
+    free(reader);
+
+    //
+    // Children we didn't get to aren't gone, so leave everything as
+    // it was (the mtime too, so that a reconcile looks again).
+    //
+    if (ret < 0) {
+	for(s=first; s <= last; s++) {
+	    for(i=start_idx[s]; i < end_idx[s]; i++) {
+		dir_shards[s].dir_items[i].state = 0;
+	    }
+	}
+	unlock_dir_shards(first, last);
+
+	for(i=0; i < num_new_dirs; i++) {
+	    free(new_dirs[i].dirname);
+	}
+	free(new_dirs);
+	for(i=0; i < num_probes; i++) {
+	    free(probes[i].dirname);
+	}
+	free(probes);
+	return -1;
+    }
+
+    home->dir_items[idx].size  = dir_size;
+    home->dir_items[idx].mtime = dir_mtime;
+
+    for(s=first; s <= last; s++) {
+	shard = &dir_shards[s];
+	for(i=start_idx[s]; i < end_idx[s]; i++) {
+	    if (shard->dir_items[i].depth == current_depth+1) {
+		if (shard->dir_items[i].dirname != NULL && shard->dir_items[i].state == 0) {
+		    // printf("DELETED item: %s\n", shard->dir_items[i].dirname);
+		    // set that directory and all of its children aside; it
+		    // may turn up again under a new name.
+		    detach_dir_and_children(shard, i);
+		} else {
+		    shard->dir_items[i].state = 0;
+		}
+	    }
+	}
+	cleanup_dir_items(shard);
+    }
+
+    unlock_dir_shards(first, last);
+
+    for(i=0; i < num_probes; i++) {
+	execute_for_path(probes[i].dirname);
+	free(probes[i].dirname);
+    }
+    free(probes);
+
+    //
+    // Now deal with the new directories.  Ones that we already know
+    // about by inode were renamed or moved, so just re-parent their
+    // state; only genuinely new ones have to be scanned.
+    //
+    for(i=0; i < num_new_dirs; i++) {
+	if (reattach_renamed_dir(new_dirs[i].dirname, new_dirs[i].ino, current_depth+1) != 0) {
+	    iterate_subdirs(new_dirs[i].dirname, 1, 1, current_depth+1);
+	}
+	free(new_dirs[i].dirname);
+    }
+    free(new_dirs);
+
+    trace(CHECK_DONE, (char *)dirname, log_event_id, trace_usecs_since(trace_start));
+
+    return 0;
+}
+
+
+//
+// Returns 1 if any file in dirname (not counting subdirectories)
+// changed since the given time.
+//
+static int
+dir_has_changed_files(const char *dirname, time_t since)
+{
+    dir_reader *reader;
+    dir_entry   entry;
+    int         changed = 0, ret;
+
+    reader = malloc(sizeof(dir_reader));
+    if (reader == NULL) {
+	return 1;
+    }
+    if (open_dir_reader(reader, dirname) != 0) {
+	free(reader);
+	return 1;
+    }
+
+    while ((ret = read_dir_entry(reader, &entry)) != 0) {
+	// if we can't tell, say so, and let check_children_of_dir() cope
+	if (ret < 0 || (!entry.is_dir && entry.ctime >= since)) {
+	    changed = 1;
+	    break;
+	}
+    }
+
+    close_dir_reader(reader);
+    free(reader);
+
+    return changed;
+}
+
+
+//
+// Copy out the names of the directories directly underneath dirname.
+//
+static int
+get_child_dirs(const char *dirname, dir_item **children, int *max_children)
+{
+    dir_shard *shard;
+    dir_item  *items;
+    int        s, i, first, last, start, end, depth = -1, num_children = 0;
+
+    lock_dir_shards(dirname, 1, &first, &last);
+
+    i = find_dir_item(path_shard(dirname), dirname);
+    if (i >= 0) {
+	depth = path_shard(dirname)->dir_items[i].depth;
+    }
+
+    for(s=first; s <= last && depth >= 0; s++) {
+	shard = &dir_shards[s];
+	items = shard->dir_items;
+	subtree_range(shard, dirname, &start, &end);
+	for(i=start; i < end; i++) {
+	    if (items[i].dirname != NULL && items[i].depth == depth+1
+		&& grow_dir_items(children, num_children, max_children) == 0) {
+		(*children)[num_children++].dirname = strdup(items[i].dirname);
+	    }
+	}
+    }
+
+    unlock_dir_shards(first, last);
+
+    return num_children;
+}
+
+
+static void
+reconcile_dir(const char *dirname, time_t since)
+{
+    dir_item    *children = NULL;
+    int          num_children, max_children = 0;
+    int          i, changed;
+    struct stat  st;
+    time_t       mtime;
+    dir_shard   *shard = path_shard(dirname);
+
+    if (in_bulk_scan && scan_cancelled()) {
+	return;
+    }
+
+    lock_dir_shard(shard, 1);
+    fault_in_path(shard, dirname);
+    i = find_dir_item(shard, dirname);
+    mtime = (i >= 0) ? shard->dir_items[i].mtime : 0;
+    unlock_dir_shard(shard);
+    if (i < 0) {
+	return;
+    }
+
+    charge_scan_budget(1, 0);
+    if (lstat(dirname, &st) != 0 || !S_ISDIR(st.st_mode)) {
+	// gone; whoever checks the parent will deal with it
+	return;
+    }
+    num_reconciled++;
+
+    if (__atomic_load_n(&stale_inodes, __ATOMIC_RELAXED)) {
+	lock_dir_shard(shard, 1);
+	i = find_dir_item(shard, dirname);
+	if (i >= 0) {
+	    shard->dir_items[i].ino = st.st_ino;
+	}
+	unlock_dir_shard(shard);
+    }
+
+    //
+    // Adding, removing or renaming an entry changes the directory's
+    // mtime.  Changes to a file (including its notes) only show up in
+    // the file's own ctime.
+    //
+    changed = (st.st_mtime != mtime || st.st_ctime >= since);
+    if (!changed) {
+	changed = dir_has_changed_files(dirname, since);
+    }
+
+    if (changed) {
+	num_reconcile_changed++;
+	check_children_of_dir(dirname);
+    }
+
+    // check_children_of_dir() may have moved things around, so go by what's there now
+    num_children = get_child_dirs(dirname, &children, &max_children);
+
+    for(i=0; i < num_children; i++) {
+	if (children[i].dirname) {
+	    reconcile_dir(children[i].dirname, since);
+	}
+	free(children[i].dirname);
+    }
+    free(children);
+}
+
+
+//
+// Bring the state for path (and everything under it) back in line
+// with the disk, when we know events were lost but not which ones.
+// Every known directory gets an lstat() and a listing, but only the
+// ones whose mtime or contents changed since the given time are
+// reconciled with check_children_of_dir(), and in those only files
+// whose ctime changed are looked at for notes.  Returns -1 if path
+// isn't something we know about, so a full scan is needed instead.
+//
+int
+reconcile_dir_items(const char *path, time_t since)
+{
+    dir_shard *shard = path_shard(path);
+    int        known;
+
+    lock_dir_shard(shard, 1);
+    fault_in_path(shard, path);
+    known = (find_dir_item(shard, path) >= 0);
+    unlock_dir_shard(shard);
+    if (!known) {
+	return -1;
+    }
+
+    num_reconciled = num_reconcile_changed = 0;
+    probe_since = since;
+
+    reconcile_dir(path, since);
+    discard_detached_dir_items();
+
+    probe_since = 0;
+    if (is_state_root(path) && !(in_bulk_scan && scan_cancelled())) {
+	set_stale_inodes(0);
+    }
+
+    log_msg(LOG_LEVEL_INFO, "Reconciled %s: %d directories checked, %d changed.  Total size is: %lld",
+	    path, num_reconciled, num_reconcile_changed, get_total_size());
+
+    return 0;
+}
+
+
+//
+// Full scans are handed to the scanner thread, which paces them by
+// the budget (if any) and works through them while events carry on
+// being handled here.  A single directory is done right away.
+//
+void
+scan_directory(const char *dirname, int add, int recursive, int depth)
+{
+    dir_shard *shard = path_shard(dirname);
+
+    lock_dir_shard(shard, 1);
+    fault_in_path(shard, dirname);
+    unlock_dir_shard(shard);
+
+    if (!recursive) {
+	iterate_subdirs(dirname, add, recursive, depth);
+	run_skim_imports();
+	return;
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    if (start_scanner() != 0) {
+	pthread_mutex_unlock(&scan_lock);
+	log_msg(LOG_LEVEL_ERROR, "can't start the scanner thread, scanning %s in the foreground", dirname);
+	iterate_subdirs(dirname, add, recursive, depth);
+	run_skim_imports();
+	return;
+    }
+    push_scan_queue(dirname, add, depth);
+    pthread_cond_signal(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+
+//
+// reconcile_dir_items() on the scanner thread, under the budget, or
+// a full scan of path if we know nothing about it.
+//
+void
+queue_reconcile(const char *path, time_t since)
+{
+    dir_item *item;
+
+    pthread_mutex_lock(&scan_lock);
+    if (start_scanner() != 0) {
+	pthread_mutex_unlock(&scan_lock);
+	if (reconcile_dir_items(path, since) != 0) {
+	    remove_dir_and_children(path);
+	    scan_directory(path, 1, 1, 0);
+	}
+	return;
+    }
+    if ((item = push_scan_queue(path, SCAN_RECONCILE, 0)) != NULL) {
+	item->mtime = since;
+    }
+    pthread_cond_signal(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+
+//
+// ----------------- portable snapshots ---------------------
+//
+// diritems.txt is no use on another machine: the paths in it are
+// absolute, the inodes are local, and without stream-info.txt there
+// is nothing to say what changed since it was written.  So with
+// -snapshot <file> a copy of the state is also written with paths
+// relative to the watched folder and without the inodes.  A relative
+// file name is taken to be inside the watched folder, so the
+// snapshot gets synced along with the papers, and a machine that has
+// no state of its own yet can start from it instead of scanning
+// everything.  The copy is put together in the state directory and
+// only moved into the watched folder when it differs from the one
+// there, since every change to the folder wakes the watcher (and
+// launchd) up again.
+//
+// The snapshot may be out of date (or come from a machine that sees
+// the folder differently), so it is checked against the disk first.
+// Every directory in it gets an lstat(), which is also how we learn
+// its local inode and mtime.  The root, the top level directories and
+// one in SNAPSHOT_SAMPLE of the rest are listed as well, and are
+// expected to have the same size (which covers every entry in them)
+// and no subdirectories that aren't in the snapshot.  The ones that
+// differ, and the parents of directories that have gone, are
+// reconciled with check_children_of_dir() looking at every file in
+// them for notes.  If too many differ the snapshot is no good and we
+// scan as usual.
+//
+// All of that is done on the scanner thread, paced by the scan budget
+// like the scan it replaces, and the shards are only locked while
+// what was found gets added.  It doesn't look at the files in the
+// directories that agree, so it is no good with -importSkim, which
+// has to come across every .skim file that arrived with the papers.
+//
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_SAMPLE     8       // one in this many directories below the top level is listed
+#define SNAPSHOT_MAX_STALE  0.25    // the fraction of listed directories that may differ
+#define SNAPSHOT_TMP        "snapshot.new"
+
+// under scan_lock
+uint64_t   num_snapshot_dirs = 0;
+uint64_t   num_snapshot_listed = 0;
+uint64_t   num_snapshot_differed = 0;
+
+//
+// Where the snapshot for settings lives, or NULL if there isn't one.
+//
+const char *
+snapshot_path(settings_t *settings, char *buff, size_t size)
+{
+    if (settings->snapshot_file == NULL) {
+	return NULL;
+    } else if (settings->snapshot_file[0] == '/') {
+	return settings->snapshot_file;
+    }
+
+    snprintf(buff, size, "%s/%s", settings->fullpath, settings->snapshot_file);
+    return buff;
+}
+
+
+static int
+same_contents(const char *name1, const char *name2)
+{
+    FILE   *fp1, *fp2;
+    char    buff1[8192], buff2[8192];
+    size_t  len1, len2;
+    int     same = 0;
+
+    fp1 = fopen(name1, "r");
+    fp2 = fopen(name2, "r");
+    if (fp1 && fp2) {
+	do {
+	    len1 = fread(buff1, 1, sizeof(buff1), fp1);
+	    len2 = fread(buff2, 1, sizeof(buff2), fp2);
+	    same = (len1 == len2 && memcmp(buff1, buff2, len1) == 0);
+	} while (same && len1 > 0);
+    }
+    if (fp1) {
+	fclose(fp1);
+    }
+    if (fp2) {
+	fclose(fp2);
+    }
+
+    return same;
+}
+
+
+//
+// Put a copy of from in place as to, for when they are on different
+// volumes and a rename won't do.  The copy is written next to to
+// first so that nobody sees half of it.
+//
+static int
+copy_into_place(const char *from, const char *to)
+{
+    FILE   *in, *out;
+    char    buff[8192], tmp_name[MAXPATHLEN];
+    size_t  len;
+    int     ret = 0;
+
+    in = fopen(from, "r");
+    if (in == NULL) {
+	return -1;
+    }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.new", to);
+    out = fopen(tmp_name, "w");
+    if (out == NULL) {
+	fclose(in);
+	return -1;
+    }
+
+    while ((len = fread(buff, 1, sizeof(buff), in)) > 0) {
+	if (fwrite(buff, 1, len, out) != len) {
+	    ret = -1;
+	    break;
+	}
+    }
+    if (ferror(in)) {
+	ret = -1;
+    }
+    fclose(in);
+    if (fclose(out) != 0) {
+	ret = -1;
+    }
+
+    if (ret == 0 && rename(tmp_name, to) != 0) {
+	ret = -1;
+    }
+    if (ret != 0) {
+	unlink(tmp_name);
+    }
+
+    return ret;
+}
+
+
+//
+// Write the state saved in items_name (by save_dir_items()) out to
+// name as a snapshot.  It is left alone if nothing changed, so that
+// other machines aren't sent the same thing again.
+//
+int
+export_snapshot(const char *items_name, const char *name)
+{
+    FILE     *fp, *out;
+    char      buff[MAXPATHLEN+64], *path;
+    int       version = 1, count = 0;
+    dir_item  item;
+
+    fp = fopen(items_name, "r");
+    if (fp == NULL) {
+	return -1;
+    }
+
+    out = fopen(SNAPSHOT_TMP, "w");
+    if (out == NULL) {
+	log_msg(LOG_LEVEL_ERROR, "can't create %s (%s)", SNAPSHOT_TMP, strerror(errno));
+	fclose(fp);
+	return -1;
+    }
+
+    fprintf(out, "# watcher-snapshot %d\n", SNAPSHOT_VERSION);
+    while (fgets(buff, sizeof(buff), fp) != NULL) {
+	if (buff[0] == '#') {
+	    sscanf(buff, "# diritems %d", &version);
+	    continue;
+	}
+	if ((path = parse_dir_item(buff, version, &item)) == NULL) {
+	    break;
+	}
+
+	if (is_state_root(path)) {
+	    path = ".";
+	} else if (strncmp(path, state_root, state_root_len) == 0 && path[state_root_len] == '/') {
+	    path += state_root_len + 1;
+	} else {
+	    continue;
+	}
+	fprintf(out, "%d %lld %s\n", (int)item.depth, (long long)item.size, path);
+	count++;
+    }
+    fclose(fp);
+
+    if (fclose(out) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "can't write %s (%s)", SNAPSHOT_TMP, strerror(errno));
+	unlink(SNAPSHOT_TMP);
+	return -1;
+    }
+
+    if (same_contents(SNAPSHOT_TMP, name)) {
+	unlink(SNAPSHOT_TMP);
+	return 0;
+    }
+    if (rename(SNAPSHOT_TMP, name) != 0
+	&& (errno != EXDEV || copy_into_place(SNAPSHOT_TMP, name) != 0)) {
+	log_msg(LOG_LEVEL_ERROR, "can't put the snapshot in %s (%s)", name, strerror(errno));
+	unlink(SNAPSHOT_TMP);
+	return -1;
+    }
+    unlink(SNAPSHOT_TMP);
+
+    log_msg(LOG_LEVEL_INFO, "Exported %d directories to %s", count, name);
+    return 0;
+}
+
+
+//
+// Returns 1 if the listing of dirname agrees with the state we have
+// for it.
+//
+static int
+snapshot_dir_matches(const char *dirname, off_t size)
+{
+    dir_reader  *reader;
+    dir_entry    entry;
+    dir_shard   *shard;
+    off_t        disk_size = 0;
+    int          matches = 1, ret;
+
+    reader = malloc(sizeof(dir_reader));
+    if (reader == NULL || open_dir_reader(reader, dirname) != 0) {
+	free(reader);
+	return 0;
+    }
+
+    while ((ret = read_dir_entry(reader, &entry)) > 0) {
+	disk_size += entry.size;
+	if (entry.is_dir && matches) {
+	    shard = path_shard(entry.path);
+	    lock_dir_shard(shard, 0);
+	    matches = (find_dir_item(shard, entry.path) >= 0);
+	    unlock_dir_shard(shard);
+	}
+    }
+    close_dir_reader(reader);
+    free(reader);
+
+    return ret == 0 && matches && disk_size == size;
+}
+
+
+static void
+free_dir_item_names(dir_item *items, int num_items)
+{
+    int i;
+
+    for(i=0; i < num_items; i++) {
+	free(items[i].dirname);
+    }
+    free(items);
+}
+
+
+//
+// Start from the snapshot in name instead of scanning.  This only
+// queues it for the scanner thread (see load_snapshot()), which
+// scans as usual if the snapshot turns out to be no good.  Returns
+// -1 if there is no snapshot to start from.
+//
+int
+import_snapshot(const char *name)
+{
+    if (access(name, R_OK) != 0) {
+	return -1;
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    if (start_scanner() != 0) {
+	pthread_mutex_unlock(&scan_lock);
+	return -1;
+    }
+    push_scan_queue(name, SCAN_SNAPSHOT, 0);
+    pthread_cond_signal(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+
+    return 0;
+}
+
+
+//
+// Runs on the scanner thread.  Returns -1, with nothing loaded, if
+// the snapshot can't be read, is too far out of date, or we were
+// cancelled part of the way through.
+//
+static int
+load_snapshot(const char *name)
+{
+    FILE        *fp;
+    char         buff[MAXPATHLEN+64], path[MAXPATHLEN], *slash;
+    int          version = 0, depth, off, s, j, first, last, i, num_listed = 0, num_stale = 0;
+    int          num_gone = 0, had[NUM_DIR_SHARDS];
+    int          num_found = 0, max_found = 0, num_sampled = 0, max_sampled = 0;
+    int          num_differ = 0, max_differ = 0;
+    long long    size;
+    struct stat  st;
+    dir_shard   *shard;
+    dir_item    *found = NULL, *sampled = NULL, *differ = NULL;
+    double       start = time_now();
+
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+	return -1;
+    }
+    if (fgets(buff, sizeof(buff), fp) == NULL
+	|| sscanf(buff, "# watcher-snapshot %d", &version) != 1 || version != SNAPSHOT_VERSION) {
+	log_msg(LOG_LEVEL_WARNING, "%s isn't a snapshot this version can read", name);
+	fclose(fp);
+	return -1;
+    }
+
+    while (fgets(buff, sizeof(buff), fp) != NULL) {
+	if (scan_cancelled()) {
+	    fclose(fp);
+	    free_dir_item_names(found, num_found);
+	    free_dir_item_names(differ, num_differ);
+	    return -1;
+	}
+
+	buff[strcspn(buff, "\n")] = '\0';
+	if (sscanf(buff, "%d %lld %n", &depth, &size, &off) != 2) {
+	    break;
+	}
+	if (strcmp(&buff[off], ".") == 0) {
+	    strlcpy(path, state_root, sizeof(path));
+	} else {
+	    snprintf(path, sizeof(path), "%s/%s", state_root, &buff[off]);
+	}
+
+	charge_scan_budget(1, 0);
+	if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+	    // gone, so its parent needs another look
+	    num_gone++;
+	    slash = strrchr(path, '/');
+	    if (depth == 0 || slash == NULL) {
+		continue;
+	    }
+	    *slash = '\0';
+	    if ((num_differ == 0 || strcmp(differ[num_differ-1].dirname, path) != 0)
+		&& grow_dir_items(&differ, num_differ, &max_differ) == 0) {
+		differ[num_differ++].dirname = strdup(path);
+	    }
+	    continue;
+	}
+
+	if (grow_dir_items(&found, num_found, &max_found) != 0) {
+	    break;
+	}
+	found[num_found].dirname = strdup(path);
+	found[num_found].depth   = depth;
+	found[num_found].size    = size;
+	found[num_found].ino     = st.st_ino;
+	found[num_found].mtime   = st.st_mtime;
+	num_found++;
+    }
+    fclose(fp);
+
+    //
+    // Live events may have added directories while we were reading,
+    // so leave those alone.
+    //
+    lock_dir_shards(NULL, 1, &first, &last);
+    for(s=first; s <= last; s++) {
+	had[s] = dir_shards[s].num_dir_items;
+    }
+    for(i=0; i < num_found; i++) {
+	shard = path_shard(found[i].dirname);
+	for(j=0; j < had[shard - dir_shards]; j++) {
+	    if (shard->dir_items[j].dirname && strcmp(shard->dir_items[j].dirname, found[i].dirname) == 0) {
+		break;
+	    }
+	}
+	if (j < had[shard - dir_shards]) {
+	    continue;
+	}
+	add_dir_item(shard, found[i].dirname, found[i].size, found[i].depth, found[i].ino, found[i].mtime);
+
+	if ((found[i].depth <= 1 || random() % SNAPSHOT_SAMPLE == 0)
+	    && grow_dir_items(&sampled, num_sampled, &max_sampled) == 0) {
+	    sampled[num_sampled].dirname = found[i].dirname;
+	    sampled[num_sampled].size    = found[i].size;
+	    found[i].dirname = NULL;
+	    num_sampled++;
+	}
+    }
+    for(s=first; s <= last; s++) {
+	cleanup_dir_items(&dir_shards[s]);
+    }
+    unlock_dir_shards(first, last);
+    free_dir_item_names(found, num_found);
+
+    for(i=0; i < num_sampled; i++) {
+	if (sampled[i].dirname == NULL) {
+	    continue;
+	}
+	if (scan_cancelled()) {
+	    free(sampled[i].dirname);
+	    continue;
+	}
+	num_listed++;
+	if (!snapshot_dir_matches(sampled[i].dirname, sampled[i].size)
+	    && grow_dir_items(&differ, num_differ, &max_differ) == 0) {
+	    differ[num_differ++].dirname = sampled[i].dirname;
+	    num_stale++;
+	} else {
+	    free(sampled[i].dirname);
+	}
+    }
+    free(sampled);
+
+    pthread_mutex_lock(&scan_lock);
+    num_snapshot_dirs     += num_found;
+    num_snapshot_listed   += num_listed;
+    num_snapshot_differed += num_stale;
+    pthread_mutex_unlock(&scan_lock);
+
+    if (scan_cancelled()) {
+	free_dir_item_names(differ, num_differ);
+	discard_all_dir_items();
+	return -1;
+    }
+    if (num_listed == 0 || num_stale > num_listed * SNAPSHOT_MAX_STALE
+	|| num_gone > (num_found + num_gone) * SNAPSHOT_MAX_STALE) {
+	log_msg(LOG_LEVEL_WARNING, "%s is out of date (%d of %d directories checked differ, %d of %d gone), scanning instead",
+		name, num_stale, num_listed, num_gone, num_found + num_gone);
+	free_dir_item_names(differ, num_differ);
+	discard_all_dir_items();
+	return -1;
+    }
+
+    //
+    // Only look again where the disk disagrees, and at every file
+    // there since we don't know which ones changed.
+    //
+    probe_since = 1;
+    for(i=0; i < num_differ; i++) {
+	if (differ[i].dirname && !scan_cancelled()) {
+	    check_children_of_dir(differ[i].dirname);
+	}
+    }
+    probe_since = 0;
+    free_dir_item_names(differ, num_differ);
+    discard_detached_dir_items();
+
+    log_msg(LOG_LEVEL_INFO, "Imported %s in %.1f ms: %d directories, %d checked, %d reconciled.  Total size is: %lld",
+	    name, (time_now() - start) * 1000, num_found, num_listed, num_differ, get_total_size());
+
+    return 0;
+}
+
+
+void
+dump_snapshot_stats(FILE *fp)
+{
+    pthread_mutex_lock(&scan_lock);
+    if (num_snapshot_dirs || num_snapshot_listed) {
+	fprintf(fp, "snapshot: %llu directories imported, %llu listed to check them, %llu differed\n",
+		(unsigned long long)num_snapshot_dirs, (unsigned long long)num_snapshot_listed,
+		(unsigned long long)num_snapshot_differed);
+    }
+    pthread_mutex_unlock(&scan_lock);
+}
+
+
+//
+// ----------------- polling ---------------------
+//
+// FSEvents only hears about changes made through this machine, so on
+// a network share (SMB, NFS, AFP) whatever other clients do goes
+// unnoticed.  With -poll (the default for volumes that aren't local)
+// the directories we know about are also checked on a timer.
+//
+// A pass lstat()s the directories that are due and calls
+// check_children_of_dir() on the ones whose mtime moved.  Most
+// applications save by writing a new file and renaming it over the
+// old one, which moves the directory's mtime too.  Notes written by
+// another client without a rename only change the file's ctime, so
+// due directories whose mtime stayed put are also listed (with
+// getattrlistbulk() that is a call or two per directory) for files
+// whose ctime moved since the directory was last looked at (which
+// each directory keeps in polled).
+//
+// Each directory has a poll level: the subtree under a directory at
+// level N is only looked at every 2^N passes.  The level goes up by
+// one every time the directory is found unchanged, and drops back to
+// 0 -- along with its parents' -- when something in it changes.  So
+// busy corners of the tree are polled every pass and idle ones every
+// 2^POLL_MAX_LEVEL passes.  Each top-level subtree comes due on a
+// different pass (by a hash of its name), so the cost of a quiet
+// tree is spread out instead of all landing on the same pass.
+//
+#define POLL_MAX_LEVEL         5       // every 32 passes
+#define POLL_DEFAULT_INTERVAL  60      // seconds, for volumes that aren't local
+
+CFRunLoopTimerRef   poll_timer=NULL;
+double              poll_interval=0;
+time_t              last_poll_time=0;
+uint64_t            num_poll_passes=0;
+uint64_t            num_poll_stats=0;
+uint64_t            num_poll_listings=0;
+uint64_t            num_poll_changed=0;
+
+//
+// Collect the directories in shard that are due this pass (with the
+// mtime we have for them and when they were last polled) into due,
+// bumping their poll level on the assumption that nothing changed.
+// Called with the shard locked for writing.
+//
+static void
+collect_due_dirs(dir_shard *shard, dir_item **due, int *num_due, int *max_due, time_t now)
+{
+    dir_item *item;
+    char      name[MAXPATHLEN];
+    time_t    cold;
+    uint64_t  offset = 0;
+    int       i, j, skip_depth = -1;
+
+    for(i=0; i < shard->num_dir_items; i++) {
+	item = &shard->dir_items[i];
+	if (item->dirname == NULL) {
+	    continue;
+	}
+	if (skip_depth >= 0) {
+	    if (item->depth > skip_depth) {
+		continue;
+	    }
+	    skip_depth = -1;
+	}
+
+	if (item->depth <= 1) {
+	    offset = item->depth ? fnv1a_hash(item->dirname, strlen(item->dirname), FNV_OFFSET_BASIS) : 0;
+	}
+	if ((num_poll_passes + offset) % (1 << item->poll_level) != 0) {
+	    // not due, and neither is anything underneath it (except
+	    // below the root, whose subtrees each have their own turn)
+	    if (item->depth > 0) {
+		skip_depth = item->depth;
+	    }
+	    continue;
+	}
+
+	if (item->flags & DIR_ITEM_EVICTED) {
+	    //
+	    // Bring it back to look at, but leave it as cold as it
+	    // was so that it can be evicted again.
+	    //
+	    cold = item->last_used;
+	    strlcpy(name, item->dirname, sizeof(name));
+	    fault_in_subtree(shard, i);
+	    i = find_dir_item(shard, name);
+	    if (i < 0) {
+		break;
+	    }
+	    for(j=i; j < shard->num_dir_items && (j == i || shard->dir_items[j].depth > shard->dir_items[i].depth); j++) {
+		shard->dir_items[j].last_used = cold;
+	    }
+	    item = &shard->dir_items[i];
+	}
+
+	if (grow_dir_items(due, *num_due, max_due) != 0) {
+	    break;
+	}
+	(*due)[*num_due].dirname = strdup(item->dirname);
+	(*due)[*num_due].mtime   = item->mtime;
+	(*due)[*num_due].polled  = item->polled;
+	(*due)[*num_due].state   = 0;
+	(*num_due)++;
+	item->polled = now;
+
+	if (item->poll_level < POLL_MAX_LEVEL) {
+	    item->poll_level++;
+	}
+    }
+}
+
+
+//
+// Something changed in path, so poll it and everything above it
+// every pass again.
+//
+static void
+reset_poll_level(const char *path)
+{
+    char       name[MAXPATHLEN], *slash;
+    dir_shard *shard;
+    int        i;
+
+    strlcpy(name, path, sizeof(name));
+    while (1) {
+	shard = path_shard(name);
+	lock_dir_shard(shard, 1);
+	if ((i = find_dir_item(shard, name)) >= 0) {
+	    shard->dir_items[i].poll_level = 0;
+	}
+	unlock_dir_shard(shard);
+
+	if (is_state_root(name) || (slash = strrchr(name, '/')) == NULL || slash == name) {
+	    break;
+	}
+	*slash = '\0';
+    }
+}
+
+
+static void
+poll_pass(void)
+{
+    dir_item    *due = NULL;
+    int          num_due = 0, max_due = 0, num_changed = 0;
+    int          s, i;
+    dir_shard   *shard;
+    struct stat  st;
+    time_t       since;
+
+    // a directory that changed within a timestamp tick of the last pass gets another look
+    since = last_poll_time - RECONCILE_SLACK;
+    last_poll_time = time(NULL);
+    num_poll_passes++;
+
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	shard = &dir_shards[s];
+	lock_dir_shard(shard, 1);
+	collect_due_dirs(shard, &due, &num_due, &max_due, last_poll_time);
+	unlock_dir_shard(shard);
+    }
+
+    //
+    // No locks are held while stat()ing, which is the slow part on
+    // a network file system.
+    //
+    for(i=0; i < num_due; i++) {
+	num_poll_stats++;
+	if (lstat(due[i].dirname, &st) != 0 || !S_ISDIR(st.st_mode)
+	    || st.st_mtime != due[i].mtime || st.st_mtime >= since) {
+	    due[i].state = 1;
+	} else {
+	    num_poll_listings++;
+	    due[i].state = dir_has_changed_files(due[i].dirname, due[i].polled - RECONCILE_SLACK);
+	}
+    }
+
+    //
+    // Parents sort before their children, so anything that went away
+    // is noticed (and detached) by its parent before we get to it.
+    //
+    for(i=0; i < num_due; i++) {
+	if (due[i].state) {
+	    num_changed++;
+	    probe_since = due[i].polled - RECONCILE_SLACK;
+	    check_children_of_dir(due[i].dirname);
+	    reset_poll_level(due[i].dirname);
+	}
+	free(due[i].dirname);
+    }
+    free(due);
+    probe_since = 0;
+
+    num_poll_changed += num_changed;
+    if (num_changed > 0) {
+	discard_detached_dir_items();
+	log_msg(LOG_LEVEL_INFO, "Poll found %d of %d directories changed.  Total size is: %lld",
+		num_changed, num_due, get_total_size());
+    } else {
+	log_msg(LOG_LEVEL_DEBUG, "Poll checked %d directories, nothing changed", num_due);
+    }
+
+    run_skim_imports();
+    enforce_memory_budget();
+}
+
+
+static void
+poll_timer_callback(CFRunLoopTimerRef timer, void *info)
+{
+    if (scan_in_progress()) {
+	// the scan will see everything anyway
+	return;
+    }
+
+    poll_pass();
+}
+
+
+//
+// interval is in seconds, 0 turns polling off and anything negative
+// means the default for the volume.
+//
+void
+set_poll_interval(double interval, int local_volume)
+{
+    if (interval < 0) {
+	interval = local_volume ? 0 : POLL_DEFAULT_INTERVAL;
+    }
+    if (interval == poll_interval) {
+	return;
+    }
+
+    if (poll_timer) {
+	CFRunLoopTimerInvalidate(poll_timer);
+	CFRelease(poll_timer);
+	poll_timer = NULL;
+    }
+
+    poll_interval = interval;
+    if (interval <= 0) {
+	return;
+    }
+
+    if (last_poll_time == 0) {
+	last_poll_time = time(NULL);
+    }
+    poll_timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + interval,
+				      interval, 0, 0, poll_timer_callback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), poll_timer, kCFRunLoopDefaultMode);
+
+    log_msg(LOG_LEVEL_INFO, "Polling for changes every %g seconds", interval);
+}
+
+
+void
+dump_poll_stats(FILE *fp)
+{
+    if (poll_interval <= 0) {
+	return;
+    }
+
+    fprintf(fp, "polling: every %g sec, %llu passes, %llu stats, %llu listings, %llu directories changed\n",
+	    poll_interval, (unsigned long long)num_poll_passes, (unsigned long long)num_poll_stats,
+	    (unsigned long long)num_poll_listings, (unsigned long long)num_poll_changed);
+}
+
+
+//
+// ----------------- idle exit ---------------------
+//
+// Papers only change a few times a day, so there is little point in
+// keeping all of this in memory the rest of the time.  With -idleExit
+// the run loop is stopped once nothing has happened for that long;
+// watch_dir_hierarchy() then saves the state and the last event id as
+// it always does on the way out, and we exit.  launchd starts us again
+// when something changes (see the plist) and FSEvents replays what
+// happened in the meantime from the saved event id, so nothing needs
+// rescanning.
+//
+// How long it takes from being launched to watching for events again
+// is measured, since it is paid on every activation.
+//
+#define IDLE_CHECK_MIN       1.0        // seconds
+#define STARTUP_TARGET_MS    50.0
+
+double              idle_exit_after=0;        // seconds, 0 = never
+CFAbsoluteTime      last_activity=0;
+CFRunLoopTimerRef   idle_timer=NULL;
+double              startup_ms=-1;
+
+void
+note_activity(void)
+{
+    last_activity = CFAbsoluteTimeGetCurrent();
+}
+
+
+//
+// When the process was launched (as a Unix time), or 0 if we can't
+// tell.
+//
+static double
+process_start_time(void)
+{
+    struct kinfo_proc info;
+    size_t            len = sizeof(info);
+    int               mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid() };
+
+    if (sysctl(mib, 4, &info, &len, NULL, 0) != 0 || len == 0) {
+	return 0;
+    }
+
+    return info.kp_proc.p_starttime.tv_sec + info.kp_proc.p_starttime.tv_usec / 1000000.0;
+}
+
+
+//
+// Called when we are about to start handling events.  start is when
+// watching began, for when the launch time isn't available.
+//
+void
+mark_ready(double start)
+{
+    struct timeval  tv;
+    double          launched = process_start_time(), now;
+
+    gettimeofday(&tv, NULL);
+    now = tv.tv_sec + tv.tv_usec / 1000000.0;
+    if (launched == 0 || launched > start) {
+	launched = start;
+    }
+
+    startup_ms = (now - launched) * 1000;
+    log_msg(startup_ms > STARTUP_TARGET_MS ? LOG_LEVEL_WARNING : LOG_LEVEL_INFO,
+	    "Ready %.1f ms after launch", startup_ms);
+    note_activity();
+}
+
+
+static void
+idle_timer_callback(CFRunLoopTimerRef timer, void *info)
+{
+    double idle = CFAbsoluteTimeGetCurrent() - last_activity;
+
+    //
+    // Polling only works while we're running, and anything that is
+    // still being scanned or converted would be lost (or done again).
+    //
+    if (idle < idle_exit_after || poll_interval > 0 || scan_in_progress() || !conversions_idle()) {
+	return;
+    }
+
+    log_msg(LOG_LEVEL_INFO, "Nothing happened for %.0f seconds, exiting until something changes", idle);
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+
+void
+set_idle_exit(double seconds)
+{
+    double interval;
+
+    if (idle_timer) {
+	CFRunLoopTimerInvalidate(idle_timer);
+	CFRelease(idle_timer);
+	idle_timer = NULL;
+    }
+
+    idle_exit_after = seconds;
+    if (seconds <= 0) {
+	return;
+    }
+
+    interval = seconds / 4 < IDLE_CHECK_MIN ? IDLE_CHECK_MIN : seconds / 4;
+    idle_timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + interval,
+				      interval, 0, 0, idle_timer_callback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), idle_timer, kCFRunLoopDefaultMode);
+
+    if (poll_interval > 0) {
+	log_msg(LOG_LEVEL_WARNING, "Polling for changes, so not exiting when idle");
+    }
+}
+
+
+void
+dump_idle_stats(FILE *fp)
+{
+    if (startup_ms >= 0) {
+	fprintf(fp, "startup: %.1f ms from launch to ready\n", startup_ms);
+    }
+    if (idle_exit_after > 0) {
+	fprintf(fp, "idle exit: after %.0f seconds, idle for %.0f\n", idle_exit_after,
+		CFAbsoluteTimeGetCurrent() - last_activity);
+    }
+}
+
+
+//
+// ----------------- run loop signal handling stuff ---------------------
+//
+// This code provides a way for a command-line CFRunLoop based
+// application to exit cleanly when you press ^C or get sent a
+// signal like SIGTERM.
+//
+// It sets up signal handlers and then creates a kqueue to
+// watch for signal events.  The kqueue is then plugged into
+// a CFFileDescriptorRef which calls a callback when there
+// is activity on the kqueue.  The callback stops the run
+// loop and that lets everything shuts down cleanly.
+//
+// SIGHUP and SIGUSR1 don't stop anything: SIGHUP reloads the
+// settings in place (see reload_settings()) and SIGUSR1 prints
+// the current stats.
+//
+CFFileDescriptorRef   kq_cffd   = NULL;
+CFRunLoopSourceRef    kq_rl_src = NULL;
+int                   kq_fd     = -1;
+
+static void
+sig_handler(int sig)
+{
+    // there's nothing to do in the signal handler...
+    // the real work happens in kq_cffd_callback where 
+    // we can safely call CFRunLoopStop()
+}
+
+
+static void
+kq_cffd_callback(CFFileDescriptorRef kq_cffd, CFOptionFlags callBackTypes, void *info)
+{
+    settings_t      *settings = (settings_t *)info;
+    struct kevent    kev[8];
+    struct timespec  no_wait = { 0, 0 };
+    int              i, n, stop = 0;
+
+    n = kevent(kq_fd, NULL, 0, kev, sizeof(kev)/sizeof(kev[0]), &no_wait);
+    for(i=0; i < n; i++) {
+	if (kev[i].ident == SIGHUP) {
+	    log_msg(LOG_LEVEL_INFO, "SIGHUP: reloading settings");
+	    reload_settings(settings);
+	} else if (kev[i].ident == SIGUSR1) {
+	    dump_stats(stdout);
+	    fflush(stdout);
+	} else {
+	    stop = 1;
+	}
+    }
+
+    if (stop || n < 0) {
+	CFRunLoopStop(CFRunLoopGetCurrent());
+    } else {
+	CFFileDescriptorEnableCallBacks(kq_cffd, kCFFileDescriptorReadCallBack);
+    }
+}
+
+
+int
+setup_run_loop_signal_handler(CFRunLoopRef loop, settings_t *settings)
+{
+    CFFileDescriptorContext my_context;
+    struct kevent           kev[5];
+
+    signal(SIGINT,  sig_handler);
+    signal(SIGQUIT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    signal(SIGHUP,  sig_handler);
+    signal(SIGUSR1, sig_handler);
+
+    kq_fd = kqueue();
+    if (kq_fd < 0) {
+	return -1;
+    }
+
+    EV_SET(&kev[0], SIGINT,  EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+    EV_SET(&kev[1], SIGQUIT, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+    EV_SET(&kev[2], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+    EV_SET(&kev[3], SIGHUP,  EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+    EV_SET(&kev[4], SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+
+    if (kevent(kq_fd, &kev[0], 5, NULL, 0, NULL) != 0) {
+	close(kq_fd);
+	return -1;
+    }
+    
+    memset(&my_context, 0, sizeof(CFFileDescriptorContext));
+    my_context.info = (void *)settings;
+
+    kq_cffd = CFFileDescriptorCreate(NULL, kq_fd, 1, kq_cffd_callback, &my_context);
+    if (kq_cffd == NULL) {
+	close(kq_fd);
+	return -1;
+    }
+
+    kq_rl_src = CFFileDescriptorCreateRunLoopSource(NULL, kq_cffd, (CFIndex)0);
+    if (kq_rl_src == NULL) {
+	// Dispose the kq_cffd
+	CFFileDescriptorInvalidate(kq_cffd);
+	CFRelease(kq_cffd);
+	kq_cffd = NULL;
+
+	return -1;
+    }
+
+    CFRunLoopAddSource(loop, kq_rl_src, kCFRunLoopDefaultMode);
+    CFFileDescriptorEnableCallBacks(kq_cffd, kCFFileDescriptorReadCallBack);
+
+    return 0;
+}
+
+
+void
+cleanup_run_loop_signal_handler(CFRunLoopRef loop)
+{
+    CFRunLoopRemoveSource(loop, kq_rl_src, kCFRunLoopDefaultMode);
+
+    CFFileDescriptorInvalidate(kq_cffd);
+    CFRelease(kq_rl_src);
+    CFRelease(kq_cffd);
+    close(kq_fd);
+
+    kq_rl_src = NULL;
+    kq_cffd   = NULL;
+    kq_fd     = -1;
+}
+
+
+//
+// ----------------- control socket stuff ---------------------
+//
+// A Unix domain socket in the working directory (next to the saved
+// state) that lets other processes poke the running daemon without
+// waiting for the stream latency.  It is served from the run loop
+// the same way as the signal kqueue above.  Each connection sends a
+// single command line:
+//
+//   sync <path>      convert a file, or reconcile a directory, right now
+//   flush            deliver every event FSEvents is still holding back
+//                    and process it before replying
+//   status [<path>]  number of directories and total size under path
+//   stats            the same output as dump_stats()
+//
+// and gets back any output followed by a line that is either "ok" or
+// "error <reason>".
+//
+#define CONTROL_SOCKET_NAME  "control.sock"
+
+CFFileDescriptorRef   ctl_cffd   = NULL;
+CFRunLoopSourceRef    ctl_rl_src = NULL;
+int                   ctl_fd     = -1;
+int                   ctl_from_launchd = 0;
+
+static int
+path_is_watched(settings_t *settings, const char *path)
+{
+    size_t len = strlen(settings->fullpath);
+
+    return strncmp(path, settings->fullpath, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+
+static void
+handle_control_command(settings_t *settings, char *command, FILE *out)
+{
+    char        *arg;
+    struct stat  st;
+    int          num_dirs;
+    off_t        size;
+
+    note_activity();
+
+    arg = strchr(command, ' ');
+    if (arg) {
+	*arg++ = '\0';
+    }
+
+    if (strcmp(command, "sync") == 0) {
+	if (arg == NULL || !path_is_watched(settings, arg)) {
+	    fprintf(out, "error not a watched path\n");
+	    return;
+	}
+	if (lstat(arg, &st) != 0) {
+	    fprintf(out, "error %s\n", strerror(errno));
+	    return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+	    if (check_children_of_dir(arg) != 0) {
+		fprintf(out, "error unknown directory\n");
+		return;
+	    }
+	    discard_detached_dir_items();
+	} else {
+	    execute_for_path(arg);
+	}
+	run_skim_imports();
+	wait_for_path_conversions(arg);
+    } else if (strcmp(command, "flush") == 0) {
+	// this calls fsevents_callback() for anything pending before returning
+	if (settings->stream_ref) {
+	    FSEventStreamFlushSync(settings->stream_ref);
+	}
+	wait_for_conversions();
+	if (scan_in_progress()) {
+	    fprintf(out, "background scan still running\n");
+	}
+    } else if (strcmp(command, "status") == 0) {
+	if (arg == NULL) {
+	    arg = (char *)settings->fullpath;
+	} else if (!path_is_watched(settings, arg)) {
+	    fprintf(out, "error not a watched path\n");
+	    return;
+	}
+	get_subtree_totals(arg, &num_dirs, &size);
+	fprintf(out, "directories: %d\nsize: %lld\n", num_dirs, (long long)size);
+    } else if (strcmp(command, "stats") == 0) {
+	dump_stats(out);
+    } else if (strcmp(command, "search") == 0) {
+	if (!__atomic_load_n(&index_notes, __ATOMIC_RELAXED)) {
+	    fprintf(out, "error notes aren't being indexed (-indexNotes)\n");
+	    return;
+	}
+	if (arg == NULL || search_notes_index(arg, out) < 0) {
+	    fprintf(out, "error nothing to search for\n");
+	    return;
+	}
+    } else {
+	fprintf(out, "error unknown command\n");
+	return;
+    }
+
+    fprintf(out, "ok\n");
+}
+
+
+static void
+ctl_cffd_callback(CFFileDescriptorRef cffd, CFOptionFlags callBackTypes, void *info)
+{
+    settings_t     *settings = (settings_t *)info;
+    char            command[PATH_MAX+32];
+    struct timeval  tv = { 1, 0 };
+    FILE           *fp;
+    int             fd, len;
+
+    fd = accept(ctl_fd, NULL, NULL);
+    if (fd >= 0) {
+	// don't let a stuck client hold up the run loop for long
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	fp = fdopen(fd, "r+");
+	if (fp == NULL) {
+	    close(fd);
+	} else {
+	    if (fgets(command, sizeof(command), fp) != NULL) {
+		len = strlen(command);
+		while (len > 0 && (command[len-1] == '\n' || command[len-1] == '\r')) {
+		    command[--len] = '\0';
+		}
+		fseeko(fp, 0, SEEK_CUR);     // switch the stream to writing
+		handle_control_command(settings, command, fp);
+	    }
+	    fclose(fp);
+	}
+    }
+
+    CFFileDescriptorEnableCallBacks(cffd, kCFFileDescriptorReadCallBack);
+}
+
+
+//
+// If launchd is holding the socket for us (the "Control" entry under
+// Sockets in the plist), a command sent while we weren't running is
+// what started us, and it's waiting to be accepted.
+//
+static int
+launchd_control_socket(void)
+{
+    int    *fds = NULL, fd;
+    size_t  num_fds = 0;
+
+    if (launch_activate_socket("Control", &fds, &num_fds) != 0 || num_fds == 0) {
+	free(fds);
+	return -1;
+    }
+
+    fd = fds[0];
+    while (num_fds > 1) {
+	close(fds[--num_fds]);
+    }
+    free(fds);
+
+    return fd;
+}
+
+
+int
+setup_control_socket(CFRunLoopRef loop, settings_t *settings)
+{
+    CFFileDescriptorContext my_context;
+    struct sockaddr_un      addr;
+    mode_t                  old_mask;
+
+    ctl_fd = launchd_control_socket();
+    ctl_from_launchd = (ctl_fd >= 0);
+    if (ctl_from_launchd) {
+	goto listening;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, CONTROL_SOCKET_NAME, sizeof(addr.sun_path));
+
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl_fd < 0) {
+	return -1;
+    }
+
+    // only we get to talk to it
+    unlink(CONTROL_SOCKET_NAME);
+    old_mask = umask(077);
+    if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ctl_fd, 8) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "can't listen on %s (%s)", CONTROL_SOCKET_NAME, strerror(errno));
+	umask(old_mask);
+	close(ctl_fd);
+	ctl_fd = -1;
+	return -1;
+    }
+    umask(old_mask);
+
+  listening:
+
+    memset(&my_context, 0, sizeof(CFFileDescriptorContext));
+    my_context.info = (void *)settings;
+
+    ctl_cffd = CFFileDescriptorCreate(NULL, ctl_fd, 1, ctl_cffd_callback, &my_context);
+    if (ctl_cffd == NULL) {
+	close(ctl_fd);
+	ctl_fd = -1;
+	return -1;
+    }
+
+    ctl_rl_src = CFFileDescriptorCreateRunLoopSource(NULL, ctl_cffd, (CFIndex)0);
+    if (ctl_rl_src == NULL) {
+	CFFileDescriptorInvalidate(ctl_cffd);
+	CFRelease(ctl_cffd);
+	ctl_cffd = NULL;
+	ctl_fd = -1;
+	return -1;
+    }
+
+    CFRunLoopAddSource(loop, ctl_rl_src, kCFRunLoopDefaultMode);
+    CFFileDescriptorEnableCallBacks(ctl_cffd, kCFFileDescriptorReadCallBack);
+
+    return 0;
+}
+
+
+void
+cleanup_control_socket(CFRunLoopRef loop)
+{
+    if (ctl_cffd == NULL) {
+	return;
+    }
+
+    CFRunLoopRemoveSource(loop, ctl_rl_src, kCFRunLoopDefaultMode);
+
+    // closeOnInvalidate was set, so this closes ctl_fd too
+    CFFileDescriptorInvalidate(ctl_cffd);
+    CFRelease(ctl_rl_src);
+    CFRelease(ctl_cffd);
+    if (!ctl_from_launchd) {
+	// launchd keeps listening on its socket to start us again
+	unlink(CONTROL_SOCKET_NAME);
+    }
+
+    ctl_rl_src = NULL;
+    ctl_cffd   = NULL;
+    ctl_fd     = -1;
+}
+
+
+//
+// The client side, for "Watcher -ctl <command>".
+//
+int
+watcher_send_command(const char *command, FILE *out)
+{
+    struct sockaddr_un addr;
+    char               line[PATH_MAX+32];
+    int                fd, ret = 1, err;
+    FILE              *fp;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, CONTROL_SOCKET_NAME, sizeof(addr.sun_path));
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+	err = errno;
+	if (fd >= 0) {
+	    close(fd);
+	}
+	errno = err;
+	return -1;
+    }
+
+    fp = fdopen(fd, "r+");
+    if (fp == NULL) {
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+    }
+    fprintf(fp, "%s\n", command);
+    fflush(fp);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	fputs(line, out);
+	if (strcmp(line, "ok\n") == 0) {
+	    ret = 0;
+	}
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+
+//
+// ----------------- importing .skim files ---------------------
+//
+// Normally notes only go one way, from the PDF's extended attribute
+// out to a .skim file.  On a machine that receives .skim files from
+// somewhere else (e.g. a fresh Dropbox install), -importSkim puts
+// them back into the PDFs' notes, so Skim doesn't have to import
+// them one at a time as each PDF is first opened.
+//
+// Imports are collected while walking directories and then run in
+// parallel batches of "skimnotes set" once the walk is done.
+//
+// For every PDF we remember a hash of the .skim contents we last
+// wrote or imported, and of the notes attribute we last imported.
+// That breaks the loop in both directions: a .skim file we wrote
+// ourselves isn't imported again, and notes we imported aren't
+// converted straight back out.  It also catches conflicts: if a new
+// .skim file arrives while the PDF has notes we haven't seen, both
+// sides changed, so the incoming file is set aside as a conflicting
+// copy and the local notes win.
+//
+#ifndef SKIMNOTES_PATH
+#define SKIMNOTES_PATH         "/Applications/Skim.app/Contents/SharedSupport/skimnotes"
+#endif
+#define SKIM_NOTES_XATTR       "net_sourceforge_skim-app_notes"
+#define SKIM_SYNC_BUCKETS      4096
+#define SKIM_IMPORT_BATCH      256
+
+typedef struct skim_sync_record {
+    struct skim_sync_record *next;
+    uint64_t                 skim_hash;     // .skim contents we last wrote or imported
+    uint64_t                 notes_hash;    // notes attribute we last imported
+    char                    *pdf_path;
+} skim_sync_record;
+
+typedef struct skim_import {
+    char      *pdf_path;
+    char      *skim_path;
+    uint64_t   skim_hash;
+    pid_t      pid;
+} skim_import;
+
+skim_sync_record *skim_sync_table[SKIM_SYNC_BUCKETS];
+skim_import      *skim_imports=NULL;
+int               num_skim_imports_pending=0;
+int               max_skim_imports_pending=0;
+int               skim_import_jobs=4;
+
+extern char **environ;
+
+void
+set_skim_import(int enabled, int jobs)
+{
+    pthread_mutex_lock(&skim_lock);
+    skim_import_jobs = jobs > 0 ? jobs : 1;
+    pthread_mutex_unlock(&skim_lock);
+    __atomic_store_n(&import_skim, enabled, __ATOMIC_RELAXED);
+}
+
+
+static int
+hash_file(const char *path, uint64_t *hash)
+{
+    char    buff[16*1024];
+    ssize_t len;
+    int     fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	return -1;
+    }
+
+    *hash = FNV_OFFSET_BASIS;
+    while ((len = read(fd, buff, sizeof(buff))) > 0) {
+	*hash = fnv1a_hash(buff, len, *hash);
+    }
+    close(fd);
+
+    return len < 0 ? -1 : 0;
+}
+
+
+//
+// Returns 1 and the hash of the notes attribute if path has notes,
+// 0 if it doesn't and -1 if they can't be read.
+//
+static int
+hash_notes_xattr(const char *path, uint64_t *hash)
+{
+    ssize_t  size, len;
+    char    *buff;
+
+    size = getxattr(path, SKIM_NOTES_XATTR, NULL, 0, 0, 0);
+    if (size <= 0) {
+	return size < 0 && errno != ENOATTR ? -1 : 0;
+    }
+
+    buff = malloc(size);
+    if (buff == NULL) {
+	return -1;
+    }
+    len = getxattr(path, SKIM_NOTES_XATTR, buff, size, 0, 0);
+    if (len < 0) {
+	free(buff);
+	return -1;
+    }
+    charge_scan_budget(1, len);
+
+    *hash = fnv1a_hash(buff, len, FNV_OFFSET_BASIS);
+    free(buff);
+
+    return 1;
+}
+
+
+//
+// Called with skim_lock held.  Records are never freed, but their
+// hashes must only be looked at or changed with the lock held.
+//
+static skim_sync_record *
+find_skim_sync_record(const char *pdf_path, int create)
+{
+    skim_sync_record *rec;
+    uint64_t          bucket;
+
+    bucket = fnv1a_hash(pdf_path, strlen(pdf_path), FNV_OFFSET_BASIS) % SKIM_SYNC_BUCKETS;
+    for(rec=skim_sync_table[bucket]; rec; rec=rec->next) {
+	if (strcmp(rec->pdf_path, pdf_path) == 0) {
+	    return rec;
+	}
+    }
+
+    if (!create) {
+	return NULL;
+    }
+
+    rec = calloc(1, sizeof(skim_sync_record));
+    if (rec == NULL) {
+	return NULL;
+    }
+    rec->pdf_path = strdup(pdf_path);
+    if (rec->pdf_path == NULL) {
+	free(rec);
+	return NULL;
+    }
+
+    rec->next = skim_sync_table[bucket];
+    skim_sync_table[bucket] = rec;
+
+    return rec;
+}
+
+
+//
+// "foo.pdf" <-> "foo.skim", which is where "skimnotes get" puts them.
+//
+static int
+swap_extension(const char *path, const char *ext, char *buff, size_t size)
+{
+    const char *dot, *slash;
+
+    dot   = strrchr(path, '.');
+    slash = strrchr(path, '/');
+    if (dot == NULL || (slash && dot < slash)) {
+	return -1;
+    }
+
+    if ((size_t)snprintf(buff, size, "%.*s%s", (int)(dot - path), path, ext) >= size) {
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+is_skim_file(const char *path)
+{
+    size_t len = strlen(path);
+
+    return len > 5 && strcmp(&path[len-5], ".skim") == 0;
+}
+
+
+//
+// Put the incoming .skim file aside as "foo (conflicting notes N).skim"
+// so nothing is lost when the local notes overwrite foo.skim.  Once
+// the numbers run out mkstemps() makes up the N, rather than us
+// renaming over one that is already there.
+//
+static void
+set_aside_conflict(const char *skim_path)
+{
+    char conflict_path[PATH_MAX];
+    int  i, fd, len = (int)(strlen(skim_path) - 5);
+
+    for(i=1; i < 100; i++) {
+	snprintf(conflict_path, sizeof(conflict_path), "%.*s (conflicting notes %d).skim", len, skim_path, i);
+	if (access(conflict_path, F_OK) != 0) {
+	    break;
+	}
+    }
+    if (i == 100) {
+	snprintf(conflict_path, sizeof(conflict_path), "%.*s (conflicting notes XXXXXX).skim", len, skim_path);
+	fd = mkstemps(conflict_path, strlen(").skim"));
+	if (fd < 0) {
+	    log_msg(LOG_LEVEL_ERROR, "Conflicting notes for %s, but nowhere to save the incoming ones (%s)",
+		    skim_path, strerror(errno));
+	    return;
+	}
+	close(fd);
+    }
+
+    log_msg(LOG_LEVEL_WARNING, "Conflicting notes for %s, keeping the local ones (incoming notes saved as %s)",
+	    skim_path, conflict_path);
+    if (rename(skim_path, conflict_path) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "failed to rename %s (%s)", skim_path, strerror(errno));
+    }
+}
+
+
+static int
+grow_skim_imports(void)
+{
+    skim_import *new_imports;
+    int          new_max;
+
+    if (num_skim_imports_pending < max_skim_imports_pending) {
+	return 0;
+    }
+
+    new_max = max_skim_imports_pending ? max_skim_imports_pending * 2 : 64;
+    new_imports = realloc(skim_imports, new_max * sizeof(skim_import));
+    if (new_imports == NULL) {
+	return -1;
+    }
+
+    skim_imports = new_imports;
+    max_skim_imports_pending = new_max;
+
+    return 0;
+}
+
+
+static void
+queue_skim_import(const char *skim_path)
+{
+    char              pdf_path[PATH_MAX];
+    struct stat       pdf_st, skim_st;
+    skim_sync_record *rec;
+    uint64_t          skim_hash, notes_hash = 0;
+    int               has_notes, batch_full;
+
+    if (swap_extension(skim_path, ".pdf", pdf_path, sizeof(pdf_path)) != 0
+	|| lstat(pdf_path, &pdf_st) != 0 || lstat(skim_path, &skim_st) != 0) {
+	return;
+    }
+
+    charge_scan_budget(1, skim_st.st_size);
+    if (hash_file(skim_path, &skim_hash) != 0) {
+	return;
+    }
+
+    pthread_mutex_lock(&skim_lock);
+    rec = find_skim_sync_record(pdf_path, 0);
+    if (rec && rec->skim_hash == skim_hash) {
+	// we wrote (or already imported) exactly this
+	num_skim_loops++;
+	pthread_mutex_unlock(&skim_lock);
+	return;
+    }
+    pthread_mutex_unlock(&skim_lock);
+
+    has_notes = hash_notes_xattr(pdf_path, &notes_hash);
+    if (has_notes < 0) {
+	return;
+    }
+
+    pthread_mutex_lock(&skim_lock);
+    if (has_notes) {
+	if (rec == NULL || rec->notes_hash != notes_hash) {
+	    // the local notes changed too and haven't been written out yet
+	    num_skim_conflicts++;
+	    pthread_mutex_unlock(&skim_lock);
+	    set_aside_conflict(skim_path);
+	    return;
+	}
+	//
+	// The notes are just as we last saw them, so this file is newer.
+	// Times can't tell: our own imports, Dropbox, Finder tags and
+	// chmod all change the PDF's ctime, and Dropbox keeps the
+	// sender's mtime on the .skim file.
+	//
+    }
+
+    if (grow_skim_imports() != 0) {
+	pthread_mutex_unlock(&skim_lock);
+	return;
+    }
+    skim_imports[num_skim_imports_pending].pdf_path  = strdup(pdf_path);
+    skim_imports[num_skim_imports_pending].skim_path = strdup(skim_path);
+    skim_imports[num_skim_imports_pending].skim_hash = skim_hash;
+    skim_imports[num_skim_imports_pending].pid       = -1;
+    num_skim_imports_pending++;
+    batch_full = (num_skim_imports_pending >= SKIM_IMPORT_BATCH);
+    pthread_mutex_unlock(&skim_lock);
+
+    if (batch_full) {
+	run_skim_imports();
+    }
+}
+
+
+static int
+start_skim_import(skim_import *import)
+{
+    char *argv[] = { "skimnotes", "set", import->pdf_path, import->skim_path, NULL };
+    int   err;
+
+    err = posix_spawn(&import->pid, SKIMNOTES_PATH, NULL, NULL, argv, environ);
+    if (err != 0) {
+	log_msg(LOG_LEVEL_ERROR, "failed to run skimnotes for %s (%s)", import->pdf_path, strerror(err));
+	import->pid = -1;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+finish_skim_import(skim_import *import, int status)
+{
+    skim_sync_record *rec;
+    uint64_t          notes_hash;
+    char             *text;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0
+	|| hash_notes_xattr(import->pdf_path, &notes_hash) != 1) {
+	log_msg(LOG_LEVEL_ERROR, "failed to import notes for %s", import->pdf_path);
+	pthread_mutex_lock(&skim_lock);
+	num_skim_import_failures++;
+	pthread_mutex_unlock(&skim_lock);
+	notify_client(WATCHER_IMPORT_FAILED, import->pdf_path);
+	return;
+    }
+
+    log_msg(LOG_LEVEL_INFO, "Imported notes for: %s", import->pdf_path);
+
+    pthread_mutex_lock(&skim_lock);
+    num_skim_imports++;
+    rec = find_skim_sync_record(import->pdf_path, 1);
+    if (rec) {
+	rec->skim_hash  = import->skim_hash;
+	rec->notes_hash = notes_hash;
+    }
+    pthread_mutex_unlock(&skim_lock);
+
+    if (__atomic_load_n(&index_notes, __ATOMIC_RELAXED)) {
+	text = read_text_notes(import->pdf_path);
+	update_notes_index(import->pdf_path, text);
+	free(text);
+    }
+
+    notify_client(WATCHER_NOTES_IMPORTED, import->pdf_path);
+}
+
+
+//
+// Run everything that queue_skim_import() collected, at most
+// skim_import_jobs at a time, and wait for all of it to finish.
+// Both the scanner and the run loop can get here, so each takes
+// the batch collected so far and runs it on its own.
+//
+void
+run_skim_imports(void)
+{
+    skim_import *imports;
+    int          num_imports, jobs;
+    int          next = 0, running = 0, done = 0, i, status;
+    pid_t        pid;
+
+    pthread_mutex_lock(&skim_lock);
+    imports     = skim_imports;
+    num_imports = num_skim_imports_pending;
+    jobs        = skim_import_jobs;
+    skim_imports = NULL;
+    num_skim_imports_pending = max_skim_imports_pending = 0;
+    pthread_mutex_unlock(&skim_lock);
+
+    while (done < num_imports) {
+	while (running < jobs && next < num_imports) {
+	    charge_scan_budget(1, 0);
+	    if (start_skim_import(&imports[next]) == 0) {
+		running++;
+	    } else {
+		pthread_mutex_lock(&skim_lock);
+		num_skim_import_failures++;
+		pthread_mutex_unlock(&skim_lock);
+		done++;
+	    }
+	    next++;
+	}
+
+	if (running == 0) {
+	    continue;
+	}
+
+	//
+	// Wait for our own children only (the oldest first), not with
+	// waitpid(-1), which could reap a conversion worker's skimnotes.
+	//
+	for(i=0; i < next && imports[i].pid < 0; i++) {
+	}
+	pid = waitpid(imports[i].pid, &status, 0);
+	if (pid < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    break;
+	}
+
+	imports[i].pid = -1;
+	finish_skim_import(&imports[i], status);
+	running--;
+	done++;
+    }
+
+    for(i=0; i < num_imports; i++) {
+	free(imports[i].pdf_path);
+	free(imports[i].skim_path);
+    }
+    free(imports);
+}
+
+
+int
+save_skim_sync_state(const char *name)
+{
+    skim_sync_record *rec;
+    char              tmp_name[PATH_MAX];
+    FILE             *fp;
+    int               i;
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.new", name);
+    fp = fopen(tmp_name, "w");
+    if (fp == NULL) {
+	return -1;
+    }
+
+    pthread_mutex_lock(&skim_lock);
+    for(i=0; i < SKIM_SYNC_BUCKETS; i++) {
+	for(rec=skim_sync_table[i]; rec; rec=rec->next) {
+	    fprintf(fp, "%016llx %016llx %s\n", (unsigned long long)rec->skim_hash,
+		    (unsigned long long)rec->notes_hash, rec->pdf_path);
+	}
+    }
+    pthread_mutex_unlock(&skim_lock);
+
+    if (fclose(fp) != 0 || rename(tmp_name, name) != 0) {
+	unlink(tmp_name);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+int
+load_skim_sync_state(const char *name)
+{
+    skim_sync_record   *rec;
+    FILE               *fp;
+    char                buff[PATH_MAX+64];
+    unsigned long long  skim_hash, notes_hash;
+    int                 offset;
+    size_t              len;
+
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+	return -1;
+    }
+
+    while (fgets(buff, sizeof(buff), fp) != NULL) {
+	len = strlen(buff);
+	if (len > 0 && buff[len-1] == '\n') {
+	    buff[--len] = '\0';
+	}
+	if (sscanf(buff, "%llx %llx %n", &skim_hash, &notes_hash, &offset) != 2) {
+	    continue;
+	}
+
+	pthread_mutex_lock(&skim_lock);
+	rec = find_skim_sync_record(&buff[offset], 1);
+	if (rec) {
+	    rec->skim_hash  = skim_hash;
+	    rec->notes_hash = notes_hash;
+	}
+	pthread_mutex_unlock(&skim_lock);
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+
+//
+// ----------------- conversion queue ---------------------
+//
+// Converting notes means running skimnotes twice, which is slow, so it
+// happens on worker threads and the run loop only finds the work.
+// After a big sync or import thousands of conversions can pile up,
+// and the paper the user has just annotated shouldn't wait behind
+// all of them, so there are two lanes:
+//
+//   interactive  live events for files whose ctime is recent
+//   bulk         everything found by scans, reconciliation and
+//                anything older
+//
+// Workers take up to INTERACTIVE_WEIGHT interactive jobs for every
+// bulk one when both lanes have work, so neither lane can starve.
+// Event-to-.skim latency is sampled per lane (from the file's ctime
+// for interactive jobs, from when it was queued for bulk ones).
+//
+// Workers don't touch the rest of the program's state, apart from
+// noting (under skim_lock) the hash of each .skim file before they
+// rename it into place, so that an event for it can't be mistaken for
+// an incoming copy.  Everything else is handed back through
+// finished_conversions and recorded by the run loop in
+// collect_finished_conversions().
+//
+// A .skim file has to be on disk before the notes are removed from
+// the PDF, or a crash can lose them.  Syncing every file on its own
+// is slow when a whole folder gets annotated, so a worker takes up to
+// group_commit queued conversions in the same directory and commits
+// them together: write every .skim to a temporary file, sync them
+// (cheaply, see sync_path()), rename them into place, fully flush the
+// directory once, and only then remove the notes from the PDFs.
+//
+#define LANE_INTERACTIVE    0
+#define LANE_BULK           1
+#define NUM_LANES           2
+#define INTERACTIVE_WEIGHT  4
+#define INTERACTIVE_WINDOW  60          // seconds
+#define CONVERSION_BUCKETS  4096
+#define LATENCY_SAMPLES     1024
+#define MAX_GROUP_COMMIT    256
+#define GROUP_SCAN_LIMIT    1024        // queued jobs looked at for more in the same directory
+
+typedef struct conversion {
+    struct conversion *next;            // in its lane, or on the finished list
+    struct conversion *prev;
+    struct conversion *hash_next;
+    struct conversion *run_next;        // on running_conversions, while a worker has it
+    struct conversion *run_prev;
+    char              *path;
+    int                lane;
+    double             event_time;
+    uint64_t           event_id;        // the event that queued it, for tracing
+    int                converted;       // set by the worker
+    uint64_t           skim_hash;
+    uint64_t           notes_hash;      // of the notes that went into the .skim file
+    char              *notes_text;      // for the notes index
+    char               tmp_path[PATH_MAX];
+} conversion;
+
+typedef struct conversion_lane {
+    conversion        *head;
+    conversion        *tail;
+    int                count;
+    uint64_t           done;
+    uint64_t           num_samples;
+    double             latency[LATENCY_SAMPLES];
+} conversion_lane;
+
+pthread_mutex_t   conversion_lock  = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t    conversion_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t    conversion_idle  = PTHREAD_COND_INITIALIZER;
+pthread_cond_t    conversion_done  = PTHREAD_COND_INITIALIZER;   // after every batch
+conversion_lane   conversion_lanes[NUM_LANES];
+const char       *lane_names[NUM_LANES] = { "interactive", "bulk" };
+conversion       *conversion_table[CONVERSION_BUCKETS];
+conversion       *finished_conversions = NULL;
+conversion       *running_conversions = NULL;
+int               conversions_running = 0;
+int               interactive_streak = 0;
+int               stopping_conversion_workers = 0;
+int               num_conversion_workers = 0;
+pthread_t        *conversion_workers = NULL;
+int               group_commit_max = 32;
+uint64_t          num_group_commits = 0;
+uint64_t          num_group_committed = 0;   // files in those commits
+uint64_t          num_commit_syncs = 0;
+double            group_commit_time = 0;     // seconds spent syncing and renaming
+
+static double
+time_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+// for probe arguments; start is 0 if nobody was tracing when it was taken
+static uint64_t
+trace_usecs_since(double start)
+{
+    return start > 0 ? (uint64_t)((time_now() - start) * 1000000) : 0;
+}
+
+
+static conversion **
+conversion_bucket(const char *path)
+{
+    return &conversion_table[fnv1a_hash(path, strlen(path), FNV_OFFSET_BASIS) % CONVERSION_BUCKETS];
+}
+
+
+static void
+unlink_conversion(conversion *conv)
+{
+    conversion_lane  *lane = &conversion_lanes[conv->lane];
+    conversion      **ptr;
+
+    if (conv->prev) {
+	conv->prev->next = conv->next;
+    } else {
+	lane->head = conv->next;
+    }
+    if (conv->next) {
+	conv->next->prev = conv->prev;
+    } else {
+	lane->tail = conv->prev;
+    }
+    lane->count--;
+
+    for(ptr=conversion_bucket(conv->path); *ptr; ptr=&(*ptr)->hash_next) {
+	if (*ptr == conv) {
+	    *ptr = conv->hash_next;
+	    break;
+	}
+    }
+    conv->next = conv->prev = conv->hash_next = NULL;
+}
+
+
+static void
+append_conversion(conversion *conv)
+{
+    conversion_lane  *lane = &conversion_lanes[conv->lane];
+    conversion      **bucket = conversion_bucket(conv->path);
+
+    conv->next = NULL;
+    conv->prev = lane->tail;
+    if (lane->tail) {
+	lane->tail->next = conv;
+    } else {
+	lane->head = conv;
+    }
+    lane->tail = conv;
+    lane->count++;
+
+    conv->hash_next = *bucket;
+    *bucket = conv;
+}
+
+
+//
+// Queue path for conversion.  A path that is already waiting isn't
+// queued twice, but gets moved up to the interactive lane if need be.
+//
+static void
+queue_conversion(const char *path, int lane, double event_time)
+{
+    conversion *conv;
+
+    pthread_mutex_lock(&conversion_lock);
+
+    for(conv=*conversion_bucket(path); conv; conv=conv->hash_next) {
+	if (strcmp(conv->path, path) == 0) {
+	    break;
+	}
+    }
+
+    if (conv) {
+	if (lane < conv->lane) {
+	    unlink_conversion(conv);
+	    conv->lane       = lane;
+	    conv->event_time = event_time;
+	    append_conversion(conv);
+	}
+    } else if ((conv = calloc(1, sizeof(conversion))) != NULL) {
+	conv->path = strdup(path);
+	if (conv->path == NULL) {
+	    free(conv);
+	} else {
+	    conv->lane       = lane;
+	    conv->event_time = event_time;
+	    conv->event_id   = log_event_id;
+	    append_conversion(conv);
+	    pthread_cond_signal(&conversion_ready);
+	}
+    }
+
+    pthread_mutex_unlock(&conversion_lock);
+}
+
+
+// called with conversion_lock held
+static conversion *
+next_conversion(void)
+{
+    conversion_lane *interactive = &conversion_lanes[LANE_INTERACTIVE];
+    conversion_lane *bulk        = &conversion_lanes[LANE_BULK];
+    conversion      *conv;
+
+    if (interactive->head && (bulk->head == NULL || interactive_streak < INTERACTIVE_WEIGHT)) {
+	conv = interactive->head;
+	interactive_streak++;
+    } else if (bulk->head) {
+	conv = bulk->head;
+	interactive_streak = 0;
+    } else {
+	return NULL;
+    }
+
+    unlink_conversion(conv);
+    return conv;
+}
+
+
+// called with conversion_lock held
+static int
+in_same_dir(const char *path, const char *dir, size_t dir_len)
+{
+    return strncmp(path, dir, dir_len) == 0 && path[dir_len] == '/'
+	&& strchr(&path[dir_len+1], '/') == NULL;
+}
+
+
+//
+// Take the next job and up to max-1 more in the same directory, from
+// its lane or a more urgent one: a bulk job never rides along with an
+// interactive one, or the interactive job would wait for it.  Called
+// with conversion_lock held.
+//
+static int
+next_conversion_batch(conversion **batch, int max)
+{
+    conversion *conv, *next;
+    const char *slash;
+    size_t      dir_len;
+    int         n = 0, l, scanned = 0;
+
+    if ((batch[n] = next_conversion()) == NULL) {
+	return 0;
+    }
+    slash   = strrchr(batch[n]->path, '/');
+    dir_len = slash ? (size_t)(slash - batch[n]->path) : 0;
+    n++;
+
+    for(l=0; l <= batch[0]->lane && n < max; l++) {
+	for(conv=conversion_lanes[l].head; conv && n < max && scanned < GROUP_SCAN_LIMIT; conv=next) {
+	    next = conv->next;
+	    scanned++;
+	    if (in_same_dir(conv->path, batch[0]->path, dir_len)) {
+		unlink_conversion(conv);
+		batch[n++] = conv;
+	    }
+	}
+    }
+
+    return n;
+}
+
+
+void
+set_group_commit(int max_files)
+{
+    pthread_mutex_lock(&conversion_lock);
+    group_commit_max = max_files < 1 ? 1 : (max_files > MAX_GROUP_COMMIT ? MAX_GROUP_COMMIT : max_files);
+    pthread_mutex_unlock(&conversion_lock);
+}
+
+
+//
+// skimnotes writes .skim files with a plain write(), so getting them
+// onto the disk is up to us.  fsync() only gets data as far as the
+// drive's cache; F_FULLFSYNC flushes that too (where it is supported),
+// but the whole cache, so it costs the same for one file as for many.
+// A batch therefore gives each file an F_BARRIERFSYNC (writes before
+// it reach the disk before writes after it) or, failing that, an
+// fsync(), and only the final sync of the directory is a full one.
+//
+static int
+sync_path(const char *path, int full)
+{
+    int fd, ret = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	return -1;
+    }
+    if (full) {
+	ret = fcntl(fd, F_FULLFSYNC);
+    }
+#ifdef F_BARRIERFSYNC
+    else {
+	ret = fcntl(fd, F_BARRIERFSYNC);
+    }
+#endif
+    if (ret != 0) {
+	ret = fsync(fd);
+    }
+    close(fd);
+
+    return ret;
+}
+
+
+static int
+run_skimnotes(const char *command, const char *path, const char *skim_path)
+{
+    char  *argv[] = { "skimnotes", (char *)command, (char *)path, (char *)skim_path, NULL };
+    pid_t  pid;
+    int    status;
+
+    if (posix_spawn(&pid, SKIMNOTES_PATH, NULL, NULL, argv, environ) != 0) {
+	return -1;
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+	if (errno != EINTR) {
+	    return -1;
+	}
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+
+//
+// Note the contents of a .skim file we are writing for pdf_path, so
+// that it isn't imported right back (see queue_skim_import()).
+//
+static void
+note_skim_written(const char *pdf_path, uint64_t skim_hash)
+{
+    skim_sync_record *rec;
+
+    pthread_mutex_lock(&skim_lock);
+    if ((rec = find_skim_sync_record(pdf_path, 1)) != NULL) {
+	rec->skim_hash  = skim_hash;
+	rec->notes_hash = 0;
+    }
+    pthread_mutex_unlock(&skim_lock);
+}
+
+
+static void
+fail_conversion(conversion *conv, const char *what)
+{
+    log_msg(LOG_LEVEL_ERROR, "failed to convert notes for %s (%s)", conv->path, what);
+    if (conv->tmp_path[0]) {
+	unlink(conv->tmp_path);
+	conv->tmp_path[0] = '\0';
+    }
+    conv->converted = -1;
+}
+
+
+//
+// Read the notes out of the xattrs of a batch of PDFs in one directory
+// and write them to their .skim files, then remove the xattrs (see
+// above for the order).  conv->converted is left at 0 if there was
+// nothing to convert and set to -1 if anything failed, in which case
+// the notes stay where they were.
+//
+// Skim may save new notes while the batch is being committed.  The
+// notes are hashed before they are read and again just before they
+// are removed, and if they changed the PDF is queued again instead,
+// so that nothing is removed that didn't make it into the .skim file.
+//
+static void
+convert_notes_batch(conversion **batch, int n)
+{
+    char        skim_path[PATH_MAX], dir[PATH_MAX], *slash;
+    double      start, elapsed, trace_start = 0;
+    int         i, fd, syncs = 0, committed = 0;
+    uint64_t    notes_hash;
+    conversion *conv;
+
+    if (tracing(CONVERT_START) || tracing(CONVERT_DONE)) {
+	trace_start = time_now();
+    }
+
+    for(i=0; i < n; i++) {
+	conv = batch[i];
+	conv->tmp_path[0] = '\0';
+	trace(CONVERT_START, conv->path, conv->event_id, conv->lane, trace_usecs_since(conv->event_time));
+
+	// it may have been converted already by an earlier event
+	if (hash_notes_xattr(conv->path, &conv->notes_hash) != 1) {
+	    continue;
+	}
+
+	log_msg(LOG_LEVEL_INFO, "Will convert notes for: %s", conv->path);
+	if (swap_extension(conv->path, ".skim", skim_path, sizeof(skim_path)) != 0) {
+	    fail_conversion(conv, "no .skim name");
+	    continue;
+	}
+
+	// a hidden name next to it, so the rename stays on the same volume
+	slash = strrchr(skim_path, '/');
+	snprintf(conv->tmp_path, sizeof(conv->tmp_path), "%.*s/.%s.XXXXXX",
+		 slash ? (int)(slash - skim_path) : 1, slash ? skim_path : ".", slash ? slash+1 : skim_path);
+	if ((fd = mkstemp(conv->tmp_path)) < 0) {
+	    conv->tmp_path[0] = '\0';
+	    fail_conversion(conv, strerror(errno));
+	    continue;
+	}
+	close(fd);
+
+	if (run_skimnotes("get", conv->path, conv->tmp_path) != 0) {
+	    fail_conversion(conv, "skimnotes get");
+	    continue;
+	}
+    }
+
+    start = time_now();
+    for(i=0; i < n; i++) {
+	conv = batch[i];
+	if (conv->tmp_path[0] == '\0') {
+	    continue;
+	}
+	syncs++;
+	if (sync_path(conv->tmp_path, 0) != 0) {
+	    fail_conversion(conv, strerror(errno));
+	}
+    }
+
+    for(i=0; i < n; i++) {
+	conv = batch[i];
+	if (conv->tmp_path[0] == '\0') {
+	    continue;
+	}
+	swap_extension(conv->path, ".skim", skim_path, sizeof(skim_path));
+
+	//
+	// Remember what we are about to write before it can be seen, so
+	// that an event for it arriving before the notes are removed
+	// from the PDF doesn't look like an incoming conflicting copy.
+	//
+	if (__atomic_load_n(&import_skim, __ATOMIC_RELAXED) && hash_file(conv->tmp_path, &conv->skim_hash) == 0) {
+	    note_skim_written(conv->path, conv->skim_hash);
+	}
+	if (rename(conv->tmp_path, skim_path) != 0) {
+	    fail_conversion(conv, strerror(errno));
+	    continue;
+	}
+	conv->tmp_path[0] = '\0';
+	conv->converted = 1;
+	committed++;
+    }
+
+    if (committed == 0) {
+	goto out;
+    }
+
+    // one full sync of the directory makes the files and the renames stick
+    strlcpy(dir, batch[0]->path, sizeof(dir));
+    slash = strrchr(dir, '/');
+    if (slash) {
+	*(slash == dir ? slash+1 : slash) = '\0';
+    }
+    syncs++;
+    if (sync_path(slash ? dir : ".", 1) != 0) {
+	for(i=0; i < n; i++) {
+	    if (batch[i]->converted == 1) {
+		fail_conversion(batch[i], "can't sync the directory");
+	    }
+	}
+	goto out;
+    }
+    elapsed = time_now() - start;
+
+    for(i=0; i < n; i++) {
+	conv = batch[i];
+	if (conv->converted != 1) {
+	    continue;
+	}
+	if (hash_notes_xattr(conv->path, &notes_hash) != 1 || notes_hash != conv->notes_hash) {
+	    log_msg(LOG_LEVEL_INFO, "Notes changed while converting, will convert again: %s", conv->path);
+	    conv->converted = 0;
+	    queue_conversion(conv->path, conv->lane, conv->event_time);
+	    continue;
+	}
+	if (__atomic_load_n(&index_notes, __ATOMIC_RELAXED)) {
+	    conv->notes_text = read_text_notes(conv->path);
+	}
+	if (run_skimnotes("remove", conv->path, NULL) != 0) {
+	    fail_conversion(conv, "skimnotes remove");
+	}
+    }
+
+    pthread_mutex_lock(&conversion_lock);
+    num_group_commits++;
+    num_group_committed += committed;
+    num_commit_syncs    += syncs;
+    group_commit_time   += elapsed;
+    pthread_mutex_unlock(&conversion_lock);
+
+  out:
+    for(i=0; tracing(CONVERT_DONE) && i < n; i++) {
+	trace(CONVERT_DONE, batch[i]->path, batch[i]->event_id, batch[i]->converted > 0,
+	      trace_usecs_since(trace_start));
+    }
+}
+
+
+static void
+convert_notes(conversion *conv)
+{
+    convert_notes_batch(&conv, 1);
+}
+
+
+// called with conversion_lock held
+static void
+start_running(conversion *conv)
+{
+    conv->run_prev = NULL;
+    conv->run_next = running_conversions;
+    if (running_conversions) {
+	running_conversions->run_prev = conv;
+    }
+    running_conversions = conv;
+}
+
+
+// called with conversion_lock held
+static void
+stop_running(conversion *conv)
+{
+    if (conv->run_prev) {
+	conv->run_prev->run_next = conv->run_next;
+    } else {
+	running_conversions = conv->run_next;
+    }
+    if (conv->run_next) {
+	conv->run_next->run_prev = conv->run_prev;
+    }
+    conv->run_next = conv->run_prev = NULL;
+}
+
+
+// called with conversion_lock held
+static void
+finish_conversion(conversion *conv)
+{
+    conversion_lane *lane = &conversion_lanes[conv->lane];
+
+    lane->done++;
+    lane->latency[lane->num_samples++ % LATENCY_SAMPLES] = time_now() - conv->event_time;
+
+    conv->next = finished_conversions;
+    finished_conversions = conv;
+}
+
+
+static void *
+conversion_worker(void *arg)
+{
+    conversion *batch[MAX_GROUP_COMMIT];
+    int         i, n;
+
+    pthread_mutex_lock(&conversion_lock);
+    while (!stopping_conversion_workers) {
+	n = next_conversion_batch(batch, group_commit_max);
+	if (n == 0) {
+	    pthread_cond_wait(&conversion_ready, &conversion_lock);
+	    continue;
+	}
+
+	conversions_running += n;
+	for(i=0; i < n; i++) {
+	    start_running(batch[i]);
+	}
+	pthread_mutex_unlock(&conversion_lock);
+
+	convert_notes_batch(batch, n);
+
+	pthread_mutex_lock(&conversion_lock);
+	conversions_running -= n;
+	for(i=0; i < n; i++) {
+	    stop_running(batch[i]);
+	    finish_conversion(batch[i]);
+	}
+	pthread_cond_broadcast(&conversion_done);
+	if (conversions_running == 0 && conversion_lanes[LANE_INTERACTIVE].head == NULL
+	    && conversion_lanes[LANE_BULK].head == NULL) {
+	    pthread_cond_broadcast(&conversion_idle);
+	}
+    }
+    pthread_mutex_unlock(&conversion_lock);
+
+    return NULL;
+}
+
+
+void
+start_conversion_workers(int num_workers)
+{
+    int i;
+
+    conversion_workers = calloc(num_workers > 0 ? num_workers : 1, sizeof(pthread_t));
+    if (conversion_workers == NULL) {
+	return;
+    }
+
+    stopping_conversion_workers = 0;
+    for(i=0; i < num_workers; i++) {
+	if (pthread_create(&conversion_workers[num_conversion_workers], NULL, conversion_worker, NULL) == 0) {
+	    num_conversion_workers++;
+	}
+    }
+}
+
+
+//
+// Stop the workers once the batches they are on are done.  Anything
+// still queued stays queued (see save_conversion_queue()).
+//
+void
+stop_conversion_workers(void)
+{
+    int i;
+
+    pthread_mutex_lock(&conversion_lock);
+    stopping_conversion_workers = 1;
+    pthread_cond_broadcast(&conversion_ready);
+    pthread_mutex_unlock(&conversion_lock);
+
+    for(i=0; i < num_conversion_workers; i++) {
+	pthread_join(conversion_workers[i], NULL);
+    }
+    free(conversion_workers);
+    conversion_workers = NULL;
+    num_conversion_workers = 0;
+
+    collect_finished_conversions();
+}
+
+
+int
+conversions_idle(void)
+{
+    int idle;
+
+    pthread_mutex_lock(&conversion_lock);
+    idle = (conversions_running == 0 && conversion_lanes[LANE_INTERACTIVE].head == NULL
+	    && conversion_lanes[LANE_BULK].head == NULL && finished_conversions == NULL);
+    pthread_mutex_unlock(&conversion_lock);
+
+    return idle;
+}
+
+
+//
+// Wait until both lanes are empty and nothing is being converted.
+// Without workers (they couldn't be started) do the work right here.
+//
+void
+wait_for_conversions(void)
+{
+    conversion *batch[MAX_GROUP_COMMIT];
+    int         i, n;
+
+    pthread_mutex_lock(&conversion_lock);
+    if (num_conversion_workers == 0) {
+	while ((n = next_conversion_batch(batch, group_commit_max)) > 0) {
+	    pthread_mutex_unlock(&conversion_lock);
+	    convert_notes_batch(batch, n);
+	    pthread_mutex_lock(&conversion_lock);
+	    for(i=0; i < n; i++) {
+		finish_conversion(batch[i]);
+	    }
+	}
+    }
+    while (conversions_running > 0 || conversion_lanes[LANE_INTERACTIVE].head
+	   || conversion_lanes[LANE_BULK].head) {
+	pthread_cond_wait(&conversion_idle, &conversion_lock);
+    }
+    pthread_mutex_unlock(&conversion_lock);
+
+    collect_finished_conversions();
+}
+
+
+// called with conversion_lock held
+static int
+conversions_under(const char *path, size_t len)
+{
+    conversion *conv;
+    int         l;
+
+    for(l=0; l < NUM_LANES; l++) {
+	for(conv=conversion_lanes[l].head; conv; conv=conv->next) {
+	    if (strncmp(conv->path, path, len) == 0 && (conv->path[len] == '\0' || conv->path[len] == '/')) {
+		return 1;
+	    }
+	}
+    }
+    for(conv=running_conversions; conv; conv=conv->run_next) {
+	if (strncmp(conv->path, path, len) == 0 && (conv->path[len] == '\0' || conv->path[len] == '/')) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+
+//
+// Wait for the conversions of path (or of anything under it) only,
+// moving them up to the interactive lane first so they don't wait
+// behind the rest of the bulk lane.
+//
+void
+wait_for_path_conversions(const char *path)
+{
+    conversion *conv, *next;
+    size_t      len = strlen(path);
+
+    if (num_conversion_workers == 0) {
+	wait_for_conversions();
+	return;
+    }
+
+    pthread_mutex_lock(&conversion_lock);
+    for(conv=conversion_lanes[LANE_BULK].head; conv; conv=next) {
+	next = conv->next;
+	if (strncmp(conv->path, path, len) == 0 && (conv->path[len] == '\0' || conv->path[len] == '/')) {
+	    unlink_conversion(conv);
+	    conv->lane = LANE_INTERACTIVE;
+	    append_conversion(conv);
+	}
+    }
+    pthread_cond_broadcast(&conversion_ready);
+
+    while (conversions_under(path, len)) {
+	pthread_cond_wait(&conversion_done, &conversion_lock);
+    }
+    pthread_mutex_unlock(&conversion_lock);
+
+    collect_finished_conversions();
+}
+
+
+//
+// On the way out whatever hasn't been converted yet is written to name
+// (one "<lane> <path>" per line) instead of being waited for, and
+// load_conversion_queue() queues it again on the next run.  Call once
+// the workers are stopped.
+//
+int
+save_conversion_queue(const char *name)
+{
+    FILE       *fp;
+    conversion *conv;
+    int         l, count = 0, ret = 0;
+
+    pthread_mutex_lock(&conversion_lock);
+    if (conversion_lanes[LANE_INTERACTIVE].head == NULL && conversion_lanes[LANE_BULK].head == NULL) {
+	pthread_mutex_unlock(&conversion_lock);
+	unlink(name);
+	return 0;
+    }
+
+    fp = fopen(name, "w");
+    for(l=0; l < NUM_LANES; l++) {
+	while ((conv = conversion_lanes[l].head) != NULL) {
+	    unlink_conversion(conv);
+	    if (fp) {
+		fprintf(fp, "%d %s\n", l, conv->path);
+		count++;
+	    }
+	    free(conv->path);
+	    free(conv);
+	}
+    }
+    pthread_mutex_unlock(&conversion_lock);
+
+    if (fp == NULL || fclose(fp) != 0) {
+	log_msg(LOG_LEVEL_ERROR, "can't save the conversion queue to %s (%s)", name, strerror(errno));
+	ret = -1;
+    } else {
+	log_msg(LOG_LEVEL_INFO, "saved %d queued conversions for next time", count);
+    }
+
+    return ret;
+}
+
+
+// for watcher_destroy(), once the workers are stopped
+void
+discard_conversion_queue(void)
+{
+    conversion *conv;
+    int         l;
+
+    pthread_mutex_lock(&conversion_lock);
+    for(l=0; l < NUM_LANES; l++) {
+	while ((conv = conversion_lanes[l].head) != NULL) {
+	    unlink_conversion(conv);
+	    free(conv->path);
+	    free(conv);
+	}
+    }
+    pthread_mutex_unlock(&conversion_lock);
+}
+
+
+void
+load_conversion_queue(const char *name)
+{
+    FILE  *fp;
+    char   buff[PATH_MAX+16];
+    int    lane, off, count = 0;
+    double now = time_now();
+
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+	return;
+    }
+    while (fgets(buff, sizeof(buff), fp) != NULL) {
+	buff[strcspn(buff, "\n")] = '\0';
+	if (sscanf(buff, "%d %n", &lane, &off) != 1 || lane < 0 || lane >= NUM_LANES) {
+	    continue;
+	}
+	queue_conversion(&buff[off], lane, now);
+	count++;
+    }
+    fclose(fp);
+    unlink(name);
+
+    log_msg(LOG_LEVEL_INFO, "queued %d conversions left over from last time", count);
+}
+
+
+//
+// Note what a conversion wrote and tell the client how it went.
+//
+static void
+record_conversion(conversion *conv)
+{
+    if (conv->notes_text) {
+	update_notes_index(conv->path, conv->notes_text);
+	free(conv->notes_text);
+	conv->notes_text = NULL;
+    }
+
+    if (conv->converted > 0) {
+	notify_client(WATCHER_NOTES_CONVERTED, conv->path);
+    } else if (conv->converted < 0) {
+	notify_client(WATCHER_CONVERSION_FAILED, conv->path);
+    }
+}
+
+
+void
+collect_finished_conversions(void)
+{
+    conversion *conv, *next;
+
+    pthread_mutex_lock(&conversion_lock);
+    conv = finished_conversions;
+    finished_conversions = NULL;
+    pthread_mutex_unlock(&conversion_lock);
+
+    for(; conv; conv=next) {
+	next = conv->next;
+	record_conversion(conv);
+	free(conv->path);
+	free(conv);
+    }
+}
+
+
+static int
+compare_doubles(const void *_a, const void *_b)
+{
+    double a = *(const double *)_a, b = *(const double *)_b;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+void
+dump_conversion_stats(FILE *fp)
+{
+    double  samples[LATENCY_SAMPLES];
+    int     i, n;
+
+    pthread_mutex_lock(&conversion_lock);
+    for(i=0; i < NUM_LANES; i++) {
+	conversion_lane *lane = &conversion_lanes[i];
+
+	n = lane->num_samples < LATENCY_SAMPLES ? (int)lane->num_samples : LATENCY_SAMPLES;
+	memcpy(samples, lane->latency, n * sizeof(double));
+	qsort(samples, n, sizeof(double), compare_doubles);
+
+	fprintf(fp, "%s conversions: %d queued, %llu done", lane_names[i], lane->count,
+		(unsigned long long)lane->done);
+	if (n > 0) {
+	    fprintf(fp, ", latency p50 %.3f p90 %.3f p99 %.3f max %.3f sec (last %d)",
+		    samples[n/2], samples[n*9/10], samples[n*99/100], samples[n-1], n);
+	}
+	fprintf(fp, "\n");
+    }
+
+    fprintf(fp, "group commits: %llu of %llu files (up to %d at a time), %llu syncs (one full flush per commit), %.3f sec",
+	    (unsigned long long)num_group_commits, (unsigned long long)num_group_committed,
+	    group_commit_max, (unsigned long long)num_commit_syncs, group_commit_time);
+    if (group_commit_time > 0) {
+	fprintf(fp, ", %.1f files/sec", num_group_committed / group_commit_time);
+    }
+    fprintf(fp, "\n");
+    pthread_mutex_unlock(&conversion_lock);
+}
+
+
+void execute_for_path(const char *path)
+{
+    skim_sync_record *rec = NULL;
+    uint64_t          notes_hash;
+    struct stat       st;
+    double            now, trace_start = 0;
+    int               lane = LANE_BULK, importing, ours = 0;
+
+    // the scanner thread gets here too
+    importing = __atomic_load_n(&import_skim, __ATOMIC_RELAXED);
+    if (importing && is_skim_file(path)) {
+	queue_skim_import(path);
+	return;
+    }
+
+    if (tracing(XATTR_PROBE)) {
+	trace_start = time_now();
+    }
+    ssize_t result = getxattr(path, SKIM_NOTES_XATTR, NULL, 0, 0, 0);
+    trace(XATTR_PROBE, (char *)path, log_event_id, result, trace_usecs_since(trace_start));
+    charge_scan_budget(1, 0);
+    if (result > 0) {
+	if (importing) {
+	    pthread_mutex_lock(&skim_lock);
+	    rec = find_skim_sync_record(path, 0);
+	    pthread_mutex_unlock(&skim_lock);
+	}
+	if (rec && hash_notes_xattr(path, &notes_hash) == 1) {
+	    pthread_mutex_lock(&skim_lock);
+	    ours = (rec->notes_hash == notes_hash);
+	    if (ours) {
+		num_skim_loops++;
+	    }
+	    pthread_mutex_unlock(&skim_lock);
+	}
+	if (ours) {
+	    // these are the notes we imported, leave them be
+	    return;
+	}
+
+	// read from the xattr and written out to the .skim file
+	charge_scan_budget(2, 2 * result);
+
+	//
+	// Something the user just did (a recent change, delivered as a
+	// live event rather than found by a scan) goes to the front.
+	//
+	now = time_now();
+	if (!in_bulk_scan && probe_since == 0 && lstat(path, &st) == 0
+	    && now - st.st_ctime <= INTERACTIVE_WINDOW) {
+	    lane = LANE_INTERACTIVE;
+	    now  = st.st_ctimespec.tv_sec + st.st_ctimespec.tv_nsec / 1000000000.0;
+	}
+	queue_conversion(path, lane, now);
+    }
+}
+
+
+//
+// ----------------- notes index ---------------------
+//
+// With -indexNotes the text of every note we convert (or import) goes
+// into a full-text index, so annotations can be searched without
+// opening every .skim file.  Skim keeps a plain text copy of the notes
+// in an attribute of its own, which is read just before the notes are
+// removed from the PDF.
+//
+// In memory the index maps each word to the sorted list of documents
+// that contain it.  Documents are numbered in the order they come in,
+// and one whose notes change just gets a new number, so lists only
+// ever grow at the end.  Compacting (below) numbers them from 0 again.
+// On disk it is a log with a line per change:
+//
+//   +<path>\t<word> <word> ...
+//   -<path>
+//
+// Once most of the log is lines that have been superseded, a
+// background thread rewrites it with just the current documents.
+// Changes carry on being appended meanwhile and are copied over
+// before the new log is renamed into place.
+//
+#define SKIM_TEXT_NOTES_XATTR  "net_sourceforge_skim-app_text_notes"
+#define INDEX_TERM_BUCKETS     16384
+#define INDEX_DOC_BUCKETS      4096
+#define INDEX_MIN_WORD         2
+#define INDEX_MAX_WORD         64
+#define INDEX_COMPACT_MIN      1024        // superseded lines before compacting is worth it
+#define INDEX_MAX_RESULTS      100
+
+typedef struct index_term {
+    struct index_term *next;
+    char              *word;
+    uint32_t          *docs;            // sorted
+    int                num_docs;
+    int                max_docs;
+} index_term;
+
+typedef struct index_doc {
+    struct index_doc  *next;
+    char              *path;
+    uint32_t           id;
+    index_term       **terms;
+    int                num_terms;
+} index_doc;
+
+pthread_mutex_t   index_lock = PTHREAD_MUTEX_INITIALIZER;
+index_term       *index_terms[INDEX_TERM_BUCKETS];
+index_doc        *index_docs[INDEX_DOC_BUCKETS];
+index_doc       **index_docs_by_id = NULL;
+uint32_t          index_next_id = 0;
+uint32_t          index_max_ids = 0;
+int               index_num_docs = 0;
+int               index_num_terms = 0;
+FILE             *index_log = NULL;
+char              index_log_name[PATH_MAX];
+uint64_t          index_log_lines = 0;
+uint64_t          num_index_updates = 0;
+uint64_t          num_index_searches = 0;
+uint64_t          num_index_compactions = 0;
+double            index_search_time = 0;
+pthread_t         index_compactor;
+int               index_compacting = 0;   // 1 while the compactor runs, 2 once it is done
+pthread_t         index_loader;
+int               index_loader_running = 0;
+int               index_loading = 0;
+pthread_cond_t    index_loaded = PTHREAD_COND_INITIALIZER;
+
+void
+set_notes_index(int enabled)
+{
+    __atomic_store_n(&index_notes, enabled, __ATOMIC_RELAXED);
+}
+
+
+//
+// The text of the notes in path, or NULL if there isn't any.
+//
+char *
+read_text_notes(const char *path)
+{
+    ssize_t  len;
+    char    *text;
+
+    len = getxattr(path, SKIM_TEXT_NOTES_XATTR, NULL, 0, 0, 0);
+    if (len < 0) {
+	return NULL;
+    }
+    text = malloc(len + 1);
+    if (text == NULL) {
+	return NULL;
+    }
+    len = getxattr(path, SKIM_TEXT_NOTES_XATTR, text, len, 0, 0);
+    if (len < 0) {
+	free(text);
+	return NULL;
+    }
+    text[len] = '\0';
+
+    return text;
+}
+
+
+static int
+compare_words(const void *_a, const void *_b)
+{
+    return strcmp(*(char * const *)_a, *(char * const *)_b);
+}
+
+
+//
+// Lower-case text in place and split it into words: runs of letters
+// and digits, with anything non-ASCII (UTF-8) counted as a letter.
+// Returns the number of distinct words, sorted, in *words.
+//
+static int
+split_words(char *text, char ***words)
+{
+    char   *p, *start, **list = NULL, **new;
+    int     n = 0, max = 0, i, j;
+    size_t  len;
+
+    for(p=text; *p; ) {
+	while (*p && !isalnum((unsigned char)*p) && !(*p & 0x80)) {
+	    p++;
+	}
+	start = p;
+	while (*p && (isalnum((unsigned char)*p) || (*p & 0x80))) {
+	    *p = tolower((unsigned char)*p);
+	    p++;
+	}
+	len = p - start;
+	if (*p) {
+	    *p++ = '\0';
+	}
+	if (len < INDEX_MIN_WORD || len > INDEX_MAX_WORD) {
+	    continue;
+	}
+
+	if (n >= max) {
+	    max = max ? max * 2 : 64;
+	    new = realloc(list, max * sizeof(char *));
+	    if (new == NULL) {
+		break;
+	    }
+	    list = new;
+	}
+	list[n++] = start;
+    }
+
+    if (n > 1) {
+	qsort(list, n, sizeof(char *), compare_words);
+    }
+    for(i=j=0; i < n; i++) {
+	if (j == 0 || strcmp(list[i], list[j-1]) != 0) {
+	    list[j++] = list[i];
+	}
+    }
+
+    *words = list;
+    return j;
+}
+
+
+// called with index_lock held
+static index_term *
+find_index_term(const char *word, int create)
+{
+    index_term **bucket, *term;
+
+    bucket = &index_terms[fnv1a_hash(word, strlen(word), FNV_OFFSET_BASIS) % INDEX_TERM_BUCKETS];
+    for(term=*bucket; term; term=term->next) {
+	if (strcmp(term->word, word) == 0) {
+	    return term;
+	}
+    }
+    if (!create) {
+	return NULL;
+    }
+
+    term = calloc(1, sizeof(index_term));
+    if (term == NULL) {
+	return NULL;
+    }
+    term->word = strdup(word);
+    if (term->word == NULL) {
+	free(term);
+	return NULL;
+    }
+    term->next = *bucket;
+    *bucket = term;
+    index_num_terms++;
+
+    return term;
+}
+
+
+static index_doc **
+index_doc_bucket(const char *path)
+{
+    return &index_docs[fnv1a_hash(path, strlen(path), FNV_OFFSET_BASIS) % INDEX_DOC_BUCKETS];
+}
+
+
+// called with index_lock held
+static index_doc **
+find_index_doc(const char *path)
+{
+    index_doc **ptr;
+
+    for(ptr=index_doc_bucket(path); *ptr; ptr=&(*ptr)->next) {
+	if (strcmp((*ptr)->path, path) == 0) {
+	    break;
+	}
+    }
+
+    return ptr;
+}
+
+
+// called with index_lock held
+static void
+remove_index_doc(const char *path)
+{
+    index_doc  **ptr, *doc;
+    index_term  *term;
+    int          i, lo, hi, mid;
+
+    ptr = find_index_doc(path);
+    doc = *ptr;
+    if (doc == NULL) {
+	return;
+    }
+    *ptr = doc->next;
+
+    for(i=0; i < doc->num_terms; i++) {
+	term = doc->terms[i];
+	lo = 0;
+	hi = term->num_docs;
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    if (term->docs[mid] < doc->id) {
+		lo = mid + 1;
+	    } else {
+		hi = mid;
+	    }
+	}
+	if (lo < term->num_docs && term->docs[lo] == doc->id) {
+	    memmove(&term->docs[lo], &term->docs[lo+1], (term->num_docs - lo - 1) * sizeof(uint32_t));
+	    term->num_docs--;
+	}
+    }
+
+    index_docs_by_id[doc->id] = NULL;
+    index_num_docs--;
+    free(doc->terms);
+    free(doc->path);
+    free(doc);
+}
+
+
+// called with index_lock held
+static void
+add_index_doc(const char *path, char **words, int num_words)
+{
+    index_doc   *doc, **new_ids;
+    index_term  *term;
+    uint32_t    *docs;
+    int          i;
+
+    remove_index_doc(path);
+    if (num_words == 0) {
+	return;
+    }
+
+    if (index_next_id >= index_max_ids) {
+	new_ids = realloc(index_docs_by_id, (index_max_ids ? index_max_ids * 2 : 1024) * sizeof(index_doc *));
+	if (new_ids == NULL) {
+	    return;
+	}
+	index_docs_by_id = new_ids;
+	index_max_ids = index_max_ids ? index_max_ids * 2 : 1024;
+    }
+
+    doc = calloc(1, sizeof(index_doc));
+    if (doc == NULL) {
+	return;
+    }
+    doc->path  = strdup(path);
+    doc->terms = malloc(num_words * sizeof(index_term *));
+    if (doc->path == NULL || doc->terms == NULL) {
+	free(doc->path);
+	free(doc->terms);
+	free(doc);
+	return;
+    }
+    doc->id = index_next_id++;
+
+    for(i=0; i < num_words; i++) {
+	term = find_index_term(words[i], 1);
+	if (term == NULL) {
+	    continue;
+	}
+	if (term->num_docs >= term->max_docs) {
+	    docs = realloc(term->docs, (term->max_docs ? term->max_docs * 2 : 4) * sizeof(uint32_t));
+	    if (docs == NULL) {
+		continue;
+	    }
+	    term->docs = docs;
+	    term->max_docs = term->max_docs ? term->max_docs * 2 : 4;
+	}
+	// ids only go up, so this keeps the list sorted
+	term->docs[term->num_docs++] = doc->id;
+	doc->terms[doc->num_terms++] = term;
+    }
+
+    doc->next = *index_doc_bucket(path);
+    *index_doc_bucket(path) = doc;
+    index_docs_by_id[doc->id] = doc;
+    index_num_docs++;
+}
+
+
+// called with index_lock held
+static void
+write_index_line(FILE *fp, const char *path, char **words, int num_words)
+{
+    int i;
+
+    if (num_words == 0) {
+	fprintf(fp, "-%s\n", path);
+	return;
+    }
+
+    fprintf(fp, "+%s\t", path);
+    for(i=0; i < num_words; i++) {
+	fprintf(fp, i ? " %s" : "%s", words[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+
+//
+// Number the documents from 0 again, keeping their order, so that
+// index_docs_by_id doesn't grow with every update for as long as we
+// run.  Called with index_lock held.
+//
+static void
+renumber_index_docs(void)
+{
+    uint32_t    *new_ids, id, next = 0;
+    index_term  *term;
+    index_doc   *doc;
+    int          b, k;
+
+    new_ids = malloc((index_next_id ? index_next_id : 1) * sizeof(uint32_t));
+    if (new_ids == NULL) {
+	return;
+    }
+    for(id=0; id < index_next_id; id++) {
+	if ((doc = index_docs_by_id[id]) != NULL) {
+	    new_ids[id] = next;
+	    doc->id = next;
+	    index_docs_by_id[next++] = doc;
+	}
+    }
+    // the new numbers are in the same order, so the lists stay sorted
+    for(b=0; b < INDEX_TERM_BUCKETS; b++) {
+	for(term=index_terms[b]; term; term=term->next) {
+	    for(k=0; k < term->num_docs; k++) {
+		term->docs[k] = new_ids[term->docs[k]];
+	    }
+	}
+    }
+    free(new_ids);
+    index_next_id = next;
+}
+
+
+static void *
+compact_notes_index(void *arg)
+{
+    char        tmp_name[PATH_MAX], buff[16*1024], *snapshot = NULL;
+    size_t      snapshot_len = 0, len;
+    off_t       offset;
+    index_doc  *doc;
+    FILE       *fp, *old = NULL, *new_log = NULL;
+    uint64_t    lines = 0;
+    uint32_t    id;
+    int         i, ok;
+
+    //
+    // Take a copy of what is current, then write it out without
+    // holding up anyone who wants to update or search the index.
+    //
+    pthread_mutex_lock(&index_lock);
+    fflush(index_log);
+    offset = ftello(index_log);
+    fp = open_memstream(&snapshot, &snapshot_len);
+    if (fp) {
+	for(id=0; id < index_next_id; id++) {
+	    if ((doc = index_docs_by_id[id]) == NULL) {
+		continue;
+	    }
+	    fprintf(fp, "+%s\t", doc->path);
+	    for(i=0; i < doc->num_terms; i++) {
+		fprintf(fp, i ? " %s" : "%s", doc->terms[i]->word);
+	    }
+	    fprintf(fp, "\n");
+	    lines++;
+	}
+	fclose(fp);
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.new", index_log_name);
+    if (fp == NULL || (fp = fopen(tmp_name, "w")) == NULL) {
+	goto out;
+    }
+    if (fwrite(snapshot, 1, snapshot_len, fp) != snapshot_len) {
+	fclose(fp);
+	fp = NULL;
+	unlink(tmp_name);
+	goto out;
+    }
+
+    // now bring over whatever was appended in the meantime
+    pthread_mutex_lock(&index_lock);
+    fflush(index_log);
+    old = fopen(index_log_name, "r");
+    ok = (old != NULL && fseeko(old, offset, SEEK_SET) == 0);
+    while (ok && (len = fread(buff, 1, sizeof(buff), old)) > 0) {
+	if (fwrite(buff, 1, len, fp) != len) {
+	    ok = 0;
+	}
+	for(i=0; i < (int)len; i++) {
+	    lines += (buff[i] == '\n');
+	}
+    }
+    if (old) {
+	if (ferror(old)) {
+	    ok = 0;
+	}
+	fclose(old);
+    }
+    if (fclose(fp) != 0) {
+	ok = 0;
+    }
+
+    //
+    // Open the new log for appending before it replaces the old one,
+    // so that if we can't, updates carry on going to the old log.
+    //
+    if (!ok || (new_log = fopen(tmp_name, "a")) == NULL || rename(tmp_name, index_log_name) != 0) {
+	if (new_log) {
+	    fclose(new_log);
+	}
+	unlink(tmp_name);
+	fp = NULL;
+    } else {
+	fclose(index_log);
+	index_log = new_log;
+	index_log_lines = lines;
+	num_index_compactions++;
+	renumber_index_docs();
+    }
+    pthread_mutex_unlock(&index_lock);
+
+  out:
+    if (fp == NULL) {
+	log_msg(LOG_LEVEL_WARNING, "can't compact the notes index (%s)", strerror(errno));
+    }
+    free(snapshot);
+
+    pthread_mutex_lock(&index_lock);
+    index_compacting = 2;
+    pthread_mutex_unlock(&index_lock);
+
+    return NULL;
+}
+
+
+// called with index_lock held
+static void
+maybe_compact_notes_index(void)
+{
+    uint64_t superseded = index_log_lines - index_num_docs;
+
+    // it has finished, so this doesn't wait
+    if (index_compacting == 2) {
+	pthread_join(index_compactor, NULL);
+	index_compacting = 0;
+    }
+
+    if (index_compacting || index_log == NULL
+	|| superseded < INDEX_COMPACT_MIN || superseded < (uint64_t)index_num_docs) {
+	return;
+    }
+
+    if (pthread_create(&index_compactor, NULL, compact_notes_index, NULL) == 0) {
+	index_compacting = 1;
+    }
+}
+
+
+//
+// The index is read on a thread of its own when we start, so as not to
+// hold up watching for events.  Anyone who needs it before then waits.
+// Called with index_lock held.
+//
+static void
+wait_for_index_load(void)
+{
+    while (index_loading) {
+	pthread_cond_wait(&index_loaded, &index_lock);
+    }
+}
+
+
+// called with index_lock held
+static void
+join_index_compactor(void)
+{
+    if (index_compacting) {
+	pthread_mutex_unlock(&index_lock);
+	pthread_join(index_compactor, NULL);
+	pthread_mutex_lock(&index_lock);
+	index_compacting = 0;
+    }
+}
+
+
+//
+// Replace what the index has for path with the words in text (no
+// words takes it out).  Can be called from any thread.
+//
+void
+update_notes_index(const char *path, const char *text)
+{
+    char  *copy, **words = NULL;
+    int    num_words;
+
+    if (!__atomic_load_n(&index_notes, __ATOMIC_RELAXED) || text == NULL) {
+	return;
+    }
+
+    copy = strdup(text);
+    if (copy == NULL) {
+	return;
+    }
+    num_words = split_words(copy, &words);
+
+    pthread_mutex_lock(&index_lock);
+    wait_for_index_load();
+    add_index_doc(path, words, num_words);
+    num_index_updates++;
+    if (index_log) {
+	write_index_line(index_log, path, words, num_words);
+	fflush(index_log);
+	index_log_lines++;
+	maybe_compact_notes_index();
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    free(words);
+    free(copy);
+}
+
+
+//
+// Print the documents whose notes have all the words in query, most
+// recently indexed first.  Returns how many there were.
+//
+int
+search_notes_index(const char *query, FILE *out)
+{
+    char        *copy, **words = NULL, *results[INDEX_MAX_RESULTS];
+    index_term **terms = NULL, *term;
+    struct stat  st;
+    double       start = time_now();
+    int          num_words, i, j, k, lo, hi, mid, found, num_matches = 0, num_results = 0;
+    uint32_t     id;
+
+    copy = strdup(query);
+    if (copy == NULL) {
+	return -1;
+    }
+    num_words = split_words(copy, &words);
+    if (num_words > 0) {
+	terms = malloc(num_words * sizeof(index_term *));
+    }
+
+    pthread_mutex_lock(&index_lock);
+    wait_for_index_load();
+
+    for(i=0; terms && i < num_words; i++) {
+	if ((terms[i] = find_index_term(words[i], 0)) == NULL || terms[i]->num_docs == 0) {
+	    break;
+	}
+	// shortest list first, the others only get binary searched
+	for(j=i; j > 0 && terms[j]->num_docs < terms[j-1]->num_docs; j--) {
+	    term = terms[j];
+	    terms[j] = terms[j-1];
+	    terms[j-1] = term;
+	}
+    }
+    found = (terms && i == num_words);
+
+    for(k=found ? terms[0]->num_docs-1 : -1; k >= 0; k--) {
+	id = terms[0]->docs[k];
+	for(i=1; i < num_words; i++) {
+	    lo = 0;
+	    hi = terms[i]->num_docs;
+	    while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (terms[i]->docs[mid] < id) {
+		    lo = mid + 1;
+		} else {
+		    hi = mid;
+		}
+	    }
+	    if (lo >= terms[i]->num_docs || terms[i]->docs[lo] != id) {
+		break;
+	    }
+	}
+	if (i < num_words) {
+	    continue;
+	}
+
+	num_matches++;
+	if (num_results < INDEX_MAX_RESULTS && (results[num_results] = strdup(index_docs_by_id[id]->path)) != NULL) {
+	    num_results++;
+	}
+    }
+
+    num_index_searches++;
+    index_search_time += time_now() - start;
+    pthread_mutex_unlock(&index_lock);
+
+    //
+    // The PDFs may have gone since.  Looking is left until the lock is
+    // let go, since on a network volume it can take a while and
+    // conversions wait for the lock to update the index.
+    //
+    for(i=0; i < num_results; i++) {
+	if (lstat(results[i], &st) == 0) {
+	    fprintf(out, "%s\n", results[i]);
+	}
+	free(results[i]);
+    }
+    fprintf(out, "matches: %d (%.3f ms)\n", num_matches, (time_now() - start) * 1000);
+
+    free(terms);
+    free(words);
+    free(copy);
+
+    return num_matches;
+}
+
+
+//
+// Read the index back from its log.  If writable, further changes are
+// appended to it.  Called with index_lock held.
+//
+static int
+replay_notes_index(const char *name, int writable)
+{
+    FILE     *fp;
+    char     *line = NULL, *tab, **words = NULL;
+    size_t    max_line = 0;
+    ssize_t   len;
+    uint64_t  lines = 0;
+    int       num_words;
+
+    join_index_compactor();
+    if (index_log) {
+	fclose(index_log);
+	index_log = NULL;
+    }
+    strlcpy(index_log_name, name, sizeof(index_log_name));
+
+    fp = fopen(name, "r");
+    if (fp) {
+	while ((len = getline(&line, &max_line, fp)) > 0) {
+	    if (line[len-1] == '\n') {
+		line[--len] = '\0';
+	    }
+	    lines++;
+	    if (line[0] == '-') {
+		remove_index_doc(&line[1]);
+	    } else if (line[0] == '+' && (tab = strchr(line, '\t')) != NULL) {
+		*tab++ = '\0';
+		num_words = split_words(tab, &words);
+		add_index_doc(&line[1], words, num_words);
+		free(words);
+		words = NULL;
+	    }
+	}
+	fclose(fp);
+	free(line);
+    }
+    index_log_lines = lines;
+
+    if (writable) {
+	index_log = fopen(name, "a");
+	if (index_log == NULL) {
+	    return -1;
+	}
+	maybe_compact_notes_index();
+    }
+
+    return (fp || writable) ? 0 : -1;
+}
+
+
+int
+load_notes_index(const char *name, int writable)
+{
+    int ret;
+
+    pthread_mutex_lock(&index_lock);
+    wait_for_index_load();
+    ret = replay_notes_index(name, writable);
+    pthread_mutex_unlock(&index_lock);
+
+    return ret;
+}
+
+
+static void *
+notes_index_loader(void *arg)
+{
+    char *name = arg;
+
+    pthread_mutex_lock(&index_lock);
+    if (replay_notes_index(name, 1) != 0) {
+	log_msg(LOG_LEVEL_WARNING, "can't open %s (%s), the notes index won't be saved", name, strerror(errno));
+    }
+    log_msg(LOG_LEVEL_INFO, "Loaded the notes index: %d documents, %d words", index_num_docs, index_num_terms);
+    index_loading = 0;
+    pthread_cond_broadcast(&index_loaded);
+    pthread_mutex_unlock(&index_lock);
+
+    free(name);
+    return NULL;
+}
+
+
+//
+// load_notes_index(name, 1) on another thread.
+//
+void
+start_loading_notes_index(const char *name)
+{
+    char *copy = strdup(name);
+
+    pthread_mutex_lock(&index_lock);
+    wait_for_index_load();
+    if (index_loader_running) {
+	pthread_join(index_loader, NULL);       // it's done
+	index_loader_running = 0;
+    }
+
+    index_loading = 1;
+    if (copy && pthread_create(&index_loader, NULL, notes_index_loader, copy) == 0) {
+	index_loader_running = 1;
+    } else {
+	index_loading = 0;
+	replay_notes_index(name, 1);
+	free(copy);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+
+void
+close_notes_index(void)
+{
+    index_term *term, *next_term;
+    index_doc  *doc, *next_doc;
+    int         i;
+
+    pthread_mutex_lock(&index_lock);
+    wait_for_index_load();
+    if (index_loader_running) {
+	pthread_join(index_loader, NULL);       // it's done
+	index_loader_running = 0;
+    }
+    join_index_compactor();
+    if (index_log) {
+	fclose(index_log);
+	index_log = NULL;
+    }
+
+    for(i=0; i < INDEX_DOC_BUCKETS; i++) {
+	for(doc=index_docs[i]; doc; doc=next_doc) {
+	    next_doc = doc->next;
+	    free(doc->terms);
+	    free(doc->path);
+	    free(doc);
+	}
+	index_docs[i] = NULL;
+    }
+    for(i=0; i < INDEX_TERM_BUCKETS; i++) {
+	for(term=index_terms[i]; term; term=next_term) {
+	    next_term = term->next;
+	    free(term->docs);
+	    free(term->word);
+	    free(term);
+	}
+	index_terms[i] = NULL;
+    }
+    free(index_docs_by_id);
+    index_docs_by_id = NULL;
+    index_next_id = index_max_ids = 0;
+    index_num_docs = index_num_terms = 0;
+    index_log_lines = 0;
+    pthread_mutex_unlock(&index_lock);
+}
+
+
+void
+dump_index_stats(FILE *fp)
+{
+    pthread_mutex_lock(&index_lock);
+    fprintf(fp, "notes index: %d documents, %d words, %llu log lines, %llu updates, %llu compactions",
+	    index_num_docs, index_num_terms, (unsigned long long)index_log_lines,
+	    (unsigned long long)num_index_updates, (unsigned long long)num_index_compactions);
+    if (num_index_searches > 0) {
+	fprintf(fp, ", %llu searches averaging %.3f ms", (unsigned long long)num_index_searches,
+		index_search_time * 1000 / num_index_searches);
+    }
+    fprintf(fp, "\n");
+    pthread_mutex_unlock(&index_lock);
+}
+
+
+//
+// ----------------- logging stuff ---------------------
+//
+// Logging must not slow down whoever is doing the logging, so
+// log_write() only formats the message into a ring buffer that
+// belongs to the calling thread.  It never takes a lock or touches
+// a file.  A flusher thread wakes up every LOG_FLUSH_MS, takes what
+// all the rings hold, sorts it by time and writes it out.  When a
+// ring fills up faster than that, new messages are dropped (and
+// counted) instead of making the caller wait.
+//
+// Errors and warnings can repeat once per file (a volume that went
+// away, a directory we can't read), so each call site may log only
+// LOG_RATE_BURST of them per LOG_RATE_WINDOW.  The next one that
+// gets through says how many were left out.
+//
+// Most messages name a file, and paths in a papers library are
+// long, so a record has room for a whole path and the text around
+// it.  Anything longer is cut at the start of a UTF-8 character,
+// never in the middle of one, so that -logJSON lines stay valid.
+//
+#define LOG_RING_SIZE    512        // records per thread, a power of two
+#define LOG_MSG_SIZE     (PATH_MAX + 256)
+#define LOG_FLUSH_MS     100
+#define LOG_RATE_SLOTS   32         // call sites remembered per thread
+#define LOG_RATE_WINDOW  10         // seconds
+#define LOG_RATE_BURST   5
+
+typedef struct log_record {
+    double           time;
+    uint64_t         event_id;
+    int              level;
+    int              thread_num;
+    char             msg[LOG_MSG_SIZE];
+} log_record;
+
+typedef struct log_rate {
+    const char      *fmt;           // identifies the call site
+    time_t           window;
+    int              count;
+    int              suppressed;
+} log_rate;
+
+//
+// Only the owning thread moves head and only the flusher moves
+// tail, so neither needs a lock.  A ring outlives its thread and
+// is handed to the next new thread once the old one has exited.
+//
+typedef struct log_ring {
+    struct log_ring *next;
+    int              thread_num;
+    int              in_use;
+    uint64_t         head;
+    uint64_t         tail;
+    uint64_t         flush_to;      // flusher only
+    log_rate         rate[LOG_RATE_SLOTS];
+    log_record       records[LOG_RING_SIZE];
+} log_ring;
+
+static const char *log_level_names[] = { "error", "warning", "info", "debug" };
+
+log_ring         *log_rings = NULL;
+__thread log_ring *my_log_ring = NULL;
+int               num_log_threads = 0;
+pthread_key_t     log_ring_key;
+pthread_once_t    log_ring_key_once = PTHREAD_ONCE_INIT;
+
+FILE             *log_fp = NULL;
+int               log_json = 0;
+int               log_running = 0;
+pthread_t         log_thread;
+pthread_mutex_t   log_lock = PTHREAD_MUTEX_INITIALIZER;   // output and flusher sleeps only
+pthread_cond_t    log_cond = PTHREAD_COND_INITIALIZER;
+
+uint64_t          num_log_records = 0;
+uint64_t          num_log_dropped = 0;
+uint64_t          num_log_suppressed = 0;
+
+
+int
+log_level_from_name(const char *name)
+{
+    int i;
+
+    for(i=0; i < sizeof(log_level_names)/sizeof(log_level_names[0]); i++) {
+	if (strcasecmp(name, log_level_names[i]) == 0) {
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+
+static void
+release_log_ring(void *arg)
+{
+    log_ring *ring = (log_ring *)arg;
+
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+static void
+create_log_ring_key(void)
+{
+    pthread_key_create(&log_ring_key, release_log_ring);
+}
+
+
+//
+// The first message from a thread gives it a ring: one left behind
+// by a thread that exited, or else a new one.
+//
+static log_ring *
+get_log_ring(void)
+{
+    log_ring *ring;
+    int       unused;
+
+    if (my_log_ring) {
+	return my_log_ring;
+    }
+
+    pthread_once(&log_ring_key_once, create_log_ring_key);
+
+    for(ring=__atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring=ring->next) {
+	unused = 0;
+	if (__atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+	    break;
+	}
+    }
+
+    if (ring == NULL) {
+	ring = calloc(1, sizeof(log_ring));
+	if (ring == NULL) {
+	    return NULL;
+	}
+	ring->in_use     = 1;
+	ring->thread_num = __atomic_fetch_add(&num_log_threads, 1, __ATOMIC_RELAXED);
+	ring->next       = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	    // somebody else added one first, try again
+	}
+    }
+
+    pthread_setspecific(log_ring_key, ring);
+    my_log_ring = ring;
+
+    return ring;
+}
+
+
+//
+// Returns -1 if the message should be left out, otherwise how many
+// were left out since the last one from this call site got through.
+//
+static int
+check_log_rate(log_ring *ring, const char *fmt, time_t now)
+{
+    log_rate *rate;
+    int       suppressed;
+
+    rate = &ring->rate[((uintptr_t)fmt >> 3) % LOG_RATE_SLOTS];
+    if (rate->fmt != fmt || now - rate->window >= LOG_RATE_WINDOW) {
+	suppressed = (rate->fmt == fmt) ? rate->suppressed : 0;
+	rate->fmt        = fmt;
+	rate->window     = now;
+	rate->count      = 1;
+	rate->suppressed = 0;
+	return suppressed;
+    }
+
+    if (rate->count >= LOG_RATE_BURST) {
+	rate->suppressed++;
+	__atomic_fetch_add(&num_log_suppressed, 1, __ATOMIC_RELAXED);
+	return -1;
+    }
+    rate->count++;
+
+    return 0;
+}
+
+
+static void
+write_log_record(log_record *rec)
+{
+    char       stamp[64];
+    struct tm  tm;
+    time_t     secs = (time_t)rec->time;
+    int        msecs = (int)((rec->time - secs) * 1000);
+    const char *ptr;
+
+    if (log_json) {
+	gmtime_r(&secs, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	fprintf(log_fp, "{\"time\":\"%s.%03dZ\",\"level\":\"%s\",\"thread\":%d,\"event\":%llu,\"msg\":\"",
+		stamp, msecs, log_level_names[rec->level], rec->thread_num,
+		(unsigned long long)rec->event_id);
+	for(ptr=rec->msg; *ptr; ptr++) {
+	    if (*ptr == '"' || *ptr == '\\') {
+		fprintf(log_fp, "\\%c", *ptr);
+	    } else if ((unsigned char)*ptr < 0x20) {
+		fprintf(log_fp, "\\u%04x", (unsigned char)*ptr);
+	    } else {
+		putc(*ptr, log_fp);
+	    }
+	}
+	fprintf(log_fp, "\"}\n");
+    } else {
+	localtime_r(&secs, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(log_fp, "%s.%03d %s: %s\n", stamp, msecs, log_level_names[rec->level], rec->msg);
+    }
+}
+
+
+//
+// Drops whatever is left of a character that got cut off at the end
+// of msg, which is len bytes long.
+//
+static void
+trim_utf8_tail(char *msg, int len)
+{
+    int start = len, need;
+
+    while (start > 0 && len - start < 4 && ((unsigned char)msg[start-1] & 0xc0) == 0x80) {
+	start--;
+    }
+    if (start == 0 || ((unsigned char)msg[start-1] & 0x80) == 0) {
+	return;             // plain ASCII, or no lead byte to go with them
+    }
+    start--;
+
+    if (((unsigned char)msg[start] & 0xe0) == 0xc0) {
+	need = 2;
+    } else if (((unsigned char)msg[start] & 0xf0) == 0xe0) {
+	need = 3;
+    } else {
+	need = 4;
+    }
+    if (len - start < need) {
+	msg[start] = '\0';
+    }
+}
+
+
+static void
+fill_log_record(log_record *rec, int level, int thread_num, const char *fmt, va_list ap, int suppressed)
+{
+    struct timeval tv;
+    int            len;
+
+    gettimeofday(&tv, NULL);
+    rec->time       = tv.tv_sec + tv.tv_usec / 1000000.0;
+    rec->event_id   = log_event_id;
+    rec->level      = level;
+    rec->thread_num = thread_num;
+
+    len = vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+    if (len >= (int)sizeof(rec->msg)) {
+	trim_utf8_tail(rec->msg, sizeof(rec->msg) - 1);
+    } else if (suppressed > 0 && len >= 0) {
+	len += snprintf(rec->msg + len, sizeof(rec->msg) - len, " (%d more like this not logged)", suppressed);
+	if (len >= (int)sizeof(rec->msg)) {
+	    trim_utf8_tail(rec->msg, sizeof(rec->msg) - 1);
+	}
+    }
+}
+
+
+void
+log_write(int level, const char *fmt, ...)
+{
+    log_ring   *ring;
+    log_record *rec, tmp;
+    uint64_t    head;
+    int         suppressed = 0;
+    va_list     ap;
+
+    ring = __atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ? get_log_ring() : NULL;
+    if (ring == NULL) {
+	// no flusher (yet, or any more), so write it out here
+	va_start(ap, fmt);
+	fill_log_record(&tmp, level, 0, fmt, ap, 0);
+	va_end(ap);
+
+	pthread_mutex_lock(&log_lock);
+	if (log_fp == NULL) {
+	    log_fp = stdout;
+	}
+	write_log_record(&tmp);
+	fflush(log_fp);
+	pthread_mutex_unlock(&log_lock);
+	return;
+    }
+
+    if (level <= LOG_LEVEL_WARNING && (suppressed = check_log_rate(ring, fmt, time(NULL))) < 0) {
+	return;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+	__atomic_fetch_add(&num_log_dropped, 1, __ATOMIC_RELAXED);
+	return;
+    }
+
+    rec = &ring->records[head & (LOG_RING_SIZE-1)];
+    va_start(ap, fmt);
+    fill_log_record(rec, level, ring->thread_num, fmt, ap, suppressed);
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+
+static int
+compare_log_records(const void *a, const void *b)
+{
+    const log_record *ra = *(const log_record **)a, *rb = *(const log_record **)b;
+
+    if (ra->time != rb->time) {
+	return (ra->time < rb->time) ? -1 : 1;
+    }
+    // same time stamp, keep each thread's messages in order
+    return (ra < rb) ? -1 : (ra > rb);
+}
+
+
+//
+// Write out everything that's in the rings right now.  Called with
+// log_lock held.
+//
+static void
+flush_log_rings(void)
+{
+    static log_record **batch = NULL;
+    static int          max_batch = 0;
+    log_ring           *ring;
+    uint64_t            pos;
+    int                 i, count = 0;
+
+    for(ring=__atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring=ring->next) {
+	ring->flush_to = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	count += (int)(ring->flush_to - ring->tail);
+    }
+    if (count == 0) {
+	return;
+    }
+
+    if (count > max_batch) {
+	log_record **new_batch = realloc(batch, count * sizeof(log_record *));
+	if (new_batch == NULL) {
+	    return;
+	}
+	batch     = new_batch;
+	max_batch = count;
+    }
+
+    count = 0;
+    for(ring=__atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring=ring->next) {
+	for(pos=ring->tail; pos < ring->flush_to; pos++) {
+	    batch[count++] = &ring->records[pos & (LOG_RING_SIZE-1)];
+	}
+    }
+
+    qsort(batch, count, sizeof(log_record *), compare_log_records);
+    for(i=0; i < count; i++) {
+	write_log_record(batch[i]);
+    }
+    fflush(log_fp);
+    num_log_records += count;
+
+    for(ring=__atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring=ring->next) {
+	__atomic_store_n(&ring->tail, ring->flush_to, __ATOMIC_RELEASE);
+    }
+}
+
+
+static void *
+log_flusher(void *arg)
+{
+    struct timeval  now;
+    struct timespec wakeup;
+
+    pthread_mutex_lock(&log_lock);
+    while (log_running) {
+	gettimeofday(&now, NULL);
+	wakeup.tv_sec  = now.tv_sec;
+	wakeup.tv_nsec = now.tv_usec * 1000 + LOG_FLUSH_MS * 1000000;
+	if (wakeup.tv_nsec >= 1000000000) {
+	    wakeup.tv_sec  += 1;
+	    wakeup.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&log_cond, &log_lock, &wakeup);
+
+	flush_log_rings();
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return NULL;
+}
+
+
+int
+start_logger(const char *log_file, int json)
+{
+    if (log_file) {
+	log_fp = fopen(log_file, "a");
+	if (log_fp == NULL) {
+	    return -1;
+	}
+    } else {
+	log_fp = stdout;
+    }
+    log_json = json;
+
+    log_running = 1;
+    if (pthread_create(&log_thread, NULL, log_flusher, NULL) != 0) {
+	// carry on, writing each message as it comes
+	log_running = 0;
+    }
+
+    return 0;
+}
+
+
+void
+stop_logger(void)
+{
+    if (!log_running) {
+	return;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+
+    pthread_join(log_thread, NULL);
+
+    // anything logged while the flusher was finishing up
+    pthread_mutex_lock(&log_lock);
+    flush_log_rings();
+    pthread_mutex_unlock(&log_lock);
+
+    if (log_fp != stdout) {
+	fclose(log_fp);
+	log_fp = stdout;
+    }
+}
+
+
+void
+dump_log_stats(FILE *fp)
+{
+    fprintf(fp, "log: %llu messages written, %llu dropped (ring full), %llu rate limited\n",
+	    (unsigned long long)num_log_records, (unsigned long long)num_log_dropped,
+	    (unsigned long long)num_log_suppressed);
+}
+
+
+//
+// ----------------- library interface ---------------------
+//
+// What Watcher.h offers.  The context mostly records the options so
+// that init_settings() can put them back over the config file every
+// time it is read; everything else is the same state the tool uses.
+//
+void
+notify_client(watcher_event event, const char *path)
+{
+    watcher_context *ctx = active_context;
+
+    if (ctx && ctx->callback) {
+	ctx->callback(ctx, event, path, ctx->callback_info);
+    }
+}
+
+
+watcher_context *
+watcher_create(const char *path)
+{
+    watcher_context *ctx;
+
+    if (active_context) {
+	errno = EBUSY;
+	return NULL;
+    }
+
+    ctx = calloc(1, sizeof(watcher_context));
+    if (ctx == NULL) {
+	return NULL;
+    }
+    pthread_mutex_init(&ctx->run_lock, NULL);
+    init_settings(ctx, &ctx->settings);
+
+    if (path && watcher_set_option(ctx, "path", path) < 0) {
+	pthread_mutex_destroy(&ctx->run_lock);
+	free(ctx);
+	return NULL;
+    }
+
+    active_context = ctx;
+    return ctx;
+}
+
+
+//
+// Not while watcher_run() is running.  Stops whatever
+// watcher_scan_tree() and watcher_convert_path() left going and puts
+// the process-wide state back the way it was, so that the next
+// context starts out with no threads and nothing known.
+//
+void
+watcher_destroy(watcher_context *ctx)
+{
+    int i;
+
+    if (ctx == NULL) {
+	return;
+    }
+
+    stop_scanner();
+    stop_conversion_workers();
+    discard_conversion_queue();
+    set_notes_index(0);
+    close_notes_index();
+    stop_logger();
+
+    set_scan_budget(0, 0);
+    set_memory_budget(0, 0);
+    set_stale_inodes(0);
+    discard_all_dir_items();
+
+    for(i=0; i < ctx->num_options; i++) {
+	free(ctx->option_names[i]);
+	free(ctx->option_values[i]);
+    }
+    free(ctx->option_names);
+    free(ctx->option_values);
+    free(ctx->config_file);
+    pthread_mutex_destroy(&ctx->run_lock);
+
+    if (active_context == ctx) {
+	active_context = NULL;
+    }
+    free(ctx);
+}
+
+
+int
+watcher_set_option(watcher_context *ctx, const char *name, const char *value)
+{
+    char **names, **values;
+    int    n;
+
+    n = parse_option(name, value, &ctx->settings);
+    if (n < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    names  = realloc(ctx->option_names, (ctx->num_options+1) * sizeof(char *));
+    if (names == NULL) {
+	return -1;
+    }
+    ctx->option_names = names;
+
+    values = realloc(ctx->option_values, (ctx->num_options+1) * sizeof(char *));
+    if (values == NULL) {
+	return -1;
+    }
+    ctx->option_values = values;
+
+    names[ctx->num_options]  = strdup(name);
+    values[ctx->num_options] = (n > 0) ? strdup(value) : NULL;
+    ctx->num_options++;
+
+    return n;
+}
+
+
+int
+watcher_load_config(watcher_context *ctx, const char *file)
+{
+    free(ctx->config_file);
+    ctx->config_file = strdup(file);
+
+    init_settings(ctx, &ctx->settings);
+    return load_config_file(file, &ctx->settings);
+}
+
+
+const char *
+watcher_get_path(watcher_context *ctx)
+{
+    return ctx->settings.fullpath;
+}
+
+
+void
+watcher_set_callback(watcher_context *ctx, watcher_callback callback, void *info)
+{
+    ctx->callback      = callback;
+    ctx->callback_info = info;
+}
+
+
+// on the thread running watcher_run(), for watcher_stop()
+static void
+stop_source_callback(void *info)
+{
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+
+int
+watcher_run(watcher_context *ctx)
+{
+    settings_t *settings = &ctx->settings;
+    CFRunLoopSourceContext context = { 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, stop_source_callback };
+    int         ret;
+
+    if (settings->fullpath == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    resolve_root(settings->fullpath, settings->root, sizeof(settings->root));
+    settings->fullpath = settings->root;
+
+    log_level = settings->log_level;
+    if (start_logger(settings->log_file, settings->log_json) != 0) {
+	fprintf(stderr, "can't open log file %s (%s)\n", settings->log_file, strerror(errno));
+	return -1;
+    }
+
+    // anything watcher_scan_tree() left behind is replaced by the saved state
+    discard_all_dir_items();
+
+    pthread_mutex_lock(&ctx->run_lock);
+    ctx->stop_source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+    if (ctx->stop_source) {
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), ctx->stop_source, kCFRunLoopDefaultMode);
+    }
+    ctx->run_loop = CFRunLoopGetCurrent();
+    pthread_mutex_unlock(&ctx->run_lock);
+
+    ret = watch_dir_hierarchy(settings);
+
+    pthread_mutex_lock(&ctx->run_lock);
+    if (ctx->stop_source) {
+	CFRunLoopRemoveSource(ctx->run_loop, ctx->stop_source, kCFRunLoopDefaultMode);
+	CFRelease(ctx->stop_source);
+	ctx->stop_source = NULL;
+    }
+    ctx->run_loop = NULL;
+    pthread_mutex_unlock(&ctx->run_lock);
+    __atomic_store_n(&ctx->stop_requested, 0, __ATOMIC_RELEASE);
+
+    stop_logger();
+
+    return ret;
+}
+
+
+void
+watcher_stop(watcher_context *ctx)
+{
+    __atomic_store_n(&ctx->stop_requested, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&ctx->run_lock);
+    if (ctx->run_loop) {
+	if (ctx->stop_source) {
+	    CFRunLoopSourceSignal(ctx->stop_source);
+	} else {
+	    CFRunLoopStop(ctx->run_loop);
+	}
+	CFRunLoopWakeUp(ctx->run_loop);
+    }
+    pthread_mutex_unlock(&ctx->run_lock);
+}
+
+
+// whether watcher_run() is running, on whichever thread
+static int
+watcher_running(watcher_context *ctx)
+{
+    int running;
+
+    pthread_mutex_lock(&ctx->run_lock);
+    running = (ctx->run_loop != NULL);
+    pthread_mutex_unlock(&ctx->run_lock);
+
+    return running;
+}
+
+
+int
+watcher_scan_tree(watcher_context *ctx, const char *path, int *num_dirs, off_t *size)
+{
+    settings_t *settings = &ctx->settings;
+    char        fullpath[PATH_MAX];
+    const char *p;
+    size_t      len;
+    int         running = watcher_running(ctx), depth = 0, dirs;
+    off_t       result, total;
+
+    if (!running) {
+	if (settings->fullpath == NULL) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	resolve_root(settings->fullpath, settings->root, sizeof(settings->root));
+	settings->fullpath = settings->root;
+	set_state_root(settings->fullpath);
+	set_bulk_attrs(!settings->no_bulk_attrs);
+    }
+
+    if (realpath(path, fullpath) == NULL) {
+	return -1;
+    }
+
+    // it has to be in the watched hierarchy
+    len = strlen(settings->fullpath);
+    if (strncmp(fullpath, settings->fullpath, len) != 0
+	|| (fullpath[len] != '\0' && fullpath[len] != '/')) {
+	errno = EINVAL;
+	return -1;
+    }
+    for(p=&fullpath[len]; *p; p++) {
+	if (*p == '/') {
+	    depth++;
+	}
+    }
+
+    remove_dir_and_children(fullpath);
+    result = iterate_subdirs(fullpath, 1, 1, depth);
+    run_skim_imports();
+
+    if (!running) {
+	wait_for_conversions();
+    }
+
+    get_subtree_totals(fullpath, &dirs, &total);
+    if (num_dirs) {
+	*num_dirs = dirs;
+    }
+    if (size) {
+	*size = total;
+    }
+
+    return result < 0 ? -1 : 0;
+}
+
+
+int
+watcher_convert_path(watcher_context *ctx, const char *path)
+{
+    conversion conv;
+
+    memset(&conv, 0, sizeof(conv));
+    conv.path = (char *)path;
+
+    convert_notes(&conv);
+    record_conversion(&conv);
+
+    return conv.converted < 0 ? -1 : (conv.converted > 0);
+}
+
+
+void
+watcher_dump_stats(watcher_context *ctx, FILE *fp)
+{
+    dump_stats(fp);
+}
+
+
+int
+watcher_search(watcher_context *ctx, const char *query, FILE *out)
+{
+    int ret;
+
+    if (watcher_running(ctx) && __atomic_load_n(&index_notes, __ATOMIC_RELAXED)) {
+	return search_notes_index(query, out);
+    }
+
+    // nothing running here, so read what the last run left
+    if (load_notes_index("notes-index.txt", 0) != 0) {
+	return -1;
+    }
+    ret = search_notes_index(query, out);
+    close_notes_index();
+
+    return ret;
+}
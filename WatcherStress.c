@@ -0,0 +1,312 @@
+/*
+File:       WatcherStress.c
+
+Abstract:   A ThreadSanitizer stress test for the directory state store
+            in WatcherLib.c.
+
+Version: <1.3>
+
+Disclaimer: IMPORTANT:  This Apple software is supplied to you by 
+Apple Inc. ("Apple") in consideration of your agreement to the
+following terms, and your use, installation, modification or
+redistribution of this Apple software constitutes acceptance of these
+terms.  If you do not agree with these terms, please do not use,
+install, modify or redistribute this Apple software.
+
+In consideration of your agreement to abide by the following terms, and
+subject to these terms, Apple grants you a personal, non-exclusive
+license, under Apple's copyrights in this original Apple software (the
+"Apple Software"), to use, reproduce, modify and redistribute the Apple
+Software, with or without modifications, in source and/or binary forms;
+provided that if you redistribute the Apple Software in its entirety and
+without modifications, you must retain this notice and the following
+text and disclaimers in all such redistributions of the Apple Software. 
+Neither the name, trademarks, service marks or logos of Apple Inc. 
+may be used to endorse or promote products derived from the Apple
+Software without specific prior written permission from Apple.  Except
+as expressly stated in this notice, no other rights or licenses, express
+or implied, are granted by Apple herein, including but not limited to
+any patent rights that may be infringed by your derivative works or by
+other works in which the Apple Software may be incorporated.
+
+The Apple Software is provided by Apple on an "AS IS" basis.  APPLE
+MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS
+FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND
+OPERATION ALONE OR IN COMBINATION WITH YOUR PRODUCTS.
+
+IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION,
+MODIFICATION AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED
+AND WHETHER UNDER THEORY OF CONTRACT, TORT (INCLUDING NEGLIGENCE),
+STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+Copyright (C) 2007 Apple Inc. All Rights Reserved.
+
+*/
+
+
+//
+// Runs the scanner thread, check_children_of_dir(), renames on the
+// disk and get_subtree_totals() all at once on a throwaway tree, then
+// checks that what we know about it agrees with a fresh scan.  It is
+// meant to be run under ThreadSanitizer:
+//
+//    cc -g -fsanitize=thread -o WatcherStress WatcherStress.c -framework CoreServices -framework CoreFoundation
+//    TSAN_OPTIONS=halt_on_error=1 ./WatcherStress [rounds]
+//
+// or, the same with the default rounds, which is what CI runs:
+//
+//    xcodebuild -project Watcher.xcodeproj -target StressTest
+//
+// It includes WatcherLib.c, rather than linking against it, so that
+// it can look at the shards.  Exits with 0 if all is well.
+//
+#include "WatcherLib.c"
+
+#define NUM_TOP         10          // d0 ... d9 below the root
+#define NUM_SUB         5           // e0 ... e4 below each of those
+#define DEFAULT_ROUNDS  200
+
+char    stress_root[MAXPATHLEN];
+int     stress_stopping = 0;
+
+//
+// Prototypes
+//
+static void  make_tree(void);
+static void *mutator(void *arg);
+static void *checker(void *arg);
+static void *totaller(void *arg);
+static int   snapshot_state(char ***lines_ptr);
+static int   compare_lines(const void *a, const void *b);
+
+
+static void
+make_tree(void)
+{
+    char  path[MAXPATHLEN];
+    int   i, j, fd;
+
+    for(i=0; i < NUM_TOP; i++) {
+	snprintf(path, sizeof(path), "%s/d%d", stress_root, i);
+	mkdir(path, 0755);
+	for(j=0; j < NUM_SUB; j++) {
+	    snprintf(path, sizeof(path), "%s/d%d/e%d", stress_root, i, j);
+	    mkdir(path, 0755);
+	    snprintf(path, sizeof(path), "%s/d%d/e%d/f", stress_root, i, j);
+	    mkdir(path, 0755);
+	    snprintf(path, sizeof(path), "%s/d%d/e%d/f/x.pdf", stress_root, i, j);
+	    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	    if (fd >= 0) {
+		ftruncate(fd, i*100 + j);
+		close(fd);
+	    }
+	}
+    }
+}
+
+
+//
+// Moves directories between top level directories (and so between
+// shards), makes and removes empty ones and grows files.
+//
+static void *
+mutator(void *arg)
+{
+    unsigned int  seed = 1;
+    char          from[MAXPATHLEN], to[MAXPATHLEN];
+    int           fd;
+
+    while (!__atomic_load_n(&stress_stopping, __ATOMIC_RELAXED)) {
+	switch (rand_r(&seed) % 4) {
+	case 0:
+	    // e's and m's, so that there is somewhere to move them to
+	    snprintf(from, sizeof(from), "%s/d%d/%c%d", stress_root, rand_r(&seed) % NUM_TOP,
+		     "em"[rand_r(&seed) % 2], rand_r(&seed) % NUM_SUB);
+	    snprintf(to, sizeof(to), "%s/d%d/%c%d", stress_root, rand_r(&seed) % NUM_TOP,
+		     "em"[rand_r(&seed) % 2], rand_r(&seed) % NUM_SUB);
+	    rename(from, to);
+	    break;
+	case 1:
+	    snprintf(from, sizeof(from), "%s/d%d/n%d", stress_root, rand_r(&seed) % NUM_TOP, rand_r(&seed) % 3);
+	    mkdir(from, 0755);
+	    break;
+	case 2:
+	    snprintf(from, sizeof(from), "%s/d%d/n%d", stress_root, rand_r(&seed) % NUM_TOP, rand_r(&seed) % 3);
+	    rmdir(from);
+	    break;
+	case 3:
+	    snprintf(from, sizeof(from), "%s/d%d/e%d/f/x.pdf", stress_root, rand_r(&seed) % NUM_TOP, rand_r(&seed) % NUM_SUB);
+	    fd = open(from, O_WRONLY|O_APPEND);
+	    if (fd >= 0) {
+		write(fd, "x", 1);
+		close(fd);
+	    }
+	    break;
+	}
+	usleep(200);
+    }
+
+    return NULL;
+}
+
+
+//
+// Does what the event handler does: checks directories as if events
+// had arrived for them.
+//
+static void *
+checker(void *arg)
+{
+    unsigned int  seed = 2;
+    char          path[MAXPATHLEN];
+
+    while (!__atomic_load_n(&stress_stopping, __ATOMIC_RELAXED)) {
+	if (rand_r(&seed) % 8 == 0) {
+	    check_children_of_dir(stress_root);
+	} else {
+	    snprintf(path, sizeof(path), "%s/d%d", stress_root, rand_r(&seed) % NUM_TOP);
+	    check_children_of_dir(path);
+	}
+	discard_detached_dir_items();
+    }
+
+    return NULL;
+}
+
+
+// what the control socket's "status" and "stats" commands do
+static void *
+totaller(void *arg)
+{
+    unsigned int  seed = 3;
+    char          path[MAXPATHLEN];
+    int           num_dirs;
+    off_t         size;
+
+    while (!__atomic_load_n(&stress_stopping, __ATOMIC_RELAXED)) {
+	get_subtree_totals(stress_root, &num_dirs, &size);
+	snprintf(path, sizeof(path), "%s/d%d", stress_root, rand_r(&seed) % NUM_TOP);
+	get_subtree_totals(path, &num_dirs, &size);
+	get_total_size();
+	dir_items_memory();
+    }
+
+    return NULL;
+}
+
+
+static int
+compare_lines(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+//
+// Everything we know, one sorted line per directory.
+//
+static int
+snapshot_state(char ***lines_ptr)
+{
+    char      **lines = NULL;
+    dir_item   *item;
+    int         s, i, num_lines = 0;
+
+    for(s=0; s < NUM_DIR_SHARDS; s++) {
+	lock_dir_shard(&dir_shards[s], 1);
+	lines = realloc(lines, (num_lines + dir_shards[s].num_dir_items) * sizeof(char *));
+	for(i=0; i < dir_shards[s].num_dir_items; i++) {
+	    item = &dir_shards[s].dir_items[i];
+	    if (item->dirname) {
+		asprintf(&lines[num_lines++], "%d %lld %s", (int)item->depth, (long long)item->size, item->dirname);
+	    }
+	}
+	unlock_dir_shard(&dir_shards[s]);
+    }
+    qsort(lines, num_lines, sizeof(char *), compare_lines);
+
+    *lines_ptr = lines;
+    return num_lines;
+}
+
+
+int
+main(int argc, const char * argv[])
+{
+    pthread_t   threads[3];
+    char        template[] = "/tmp/WatcherStress.XXXXXX", cmd[MAXPATHLEN+16];
+    char      **known, **scanned;
+    int         rounds = DEFAULT_ROUNDS, i, num_known, num_scanned, bad = 0;
+
+    if (argc > 1) {
+	rounds = atoi(argv[1]);
+    }
+    if (mkdtemp(template) == NULL || realpath(template, stress_root) == NULL) {
+	fprintf(stderr, "can't make a directory to work in (%s)\n", strerror(errno));
+	exit(1);
+    }
+    log_level = LOG_LEVEL_ERROR;          // the others race with us, and say so
+
+    make_tree();
+    set_state_root(stress_root);
+    scan_directory(stress_root, 1, 1, 0);
+
+    pthread_create(&threads[0], NULL, mutator, NULL);
+    pthread_create(&threads[1], NULL, checker, NULL);
+    pthread_create(&threads[2], NULL, totaller, NULL);
+
+    for(i=0; i < rounds; i++) {
+	// have the scanner go over it all again while the others carry on
+	if (i % 20 == 0) {
+	    scan_directory(stress_root, 1, 1, 0);
+	}
+	usleep(10000);
+    }
+
+    __atomic_store_n(&stress_stopping, 1, __ATOMIC_RELAXED);
+    for(i=0; i < 3; i++) {
+	pthread_join(threads[i], NULL);
+    }
+    while (scan_in_progress()) {
+	usleep(10000);
+    }
+
+    //
+    // Once things are quiet one pass over everything should bring us
+    // back in line with the disk.
+    //
+    reconcile_dir_items(stress_root, 0);
+    num_known = snapshot_state(&known);
+
+    discard_all_dir_items();
+    scan_directory(stress_root, 1, 1, 0);
+    while (scan_in_progress()) {
+	usleep(10000);
+    }
+    num_scanned = snapshot_state(&scanned);
+    stop_scanner();
+
+    if (num_known != num_scanned) {
+	printf("%d directories known, but %d scanned\n", num_known, num_scanned);
+	bad = 1;
+    }
+    for(i=0; i < num_known && i < num_scanned; i++) {
+	if (strcmp(known[i], scanned[i]) != 0) {
+	    printf("known:   %s\nscanned: %s\n", known[i], scanned[i]);
+	    bad = 1;
+	    break;
+	}
+    }
+    printf("%s: %d rounds, %d directories, total size %lld\n", bad ? "FAILED" : "ok", rounds,
+	   num_scanned, (long long)get_total_size());
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", stress_root);
+    system(cmd);
+
+    return bad;
+}